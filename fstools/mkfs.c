@@ -35,8 +35,9 @@ void rblock(uint sec, void *buf);
 // Entry point
 int main(int argc, char *argv[])
 {
-  int i, f, e, b, cc, fd;
+  int i, f, e, b, cc, fd, bitmap_size;
   char *name;
+  unsigned char *bitmap;
   char buf[BLOCK_SIZE];
   sfs_superblock_t sfs_sb;
   sfs_entry_t *sfs_entry;
@@ -90,13 +91,16 @@ int main(int argc, char *argv[])
   sfs_sb.type = SFS_TYPE_ID;
   sfs_sb.size = fssize_blocks;
   sfs_sb.nentries = numentries;
-  sfs_sb.bootstart = 2 + entries_size/BLOCK_SIZE;
+  sfs_sb.bitmapstart = 2 + entries_size/BLOCK_SIZE;
+  sfs_sb.bitmapblocks = (fssize_blocks + SFS_BITMAPBITS - 1) / SFS_BITMAPBITS;
+  sfs_sb.bootstart = sfs_sb.bitmapstart + sfs_sb.bitmapblocks;
 
   memmove(buf, &sfs_sb, sizeof(sfs_sb));
   wblock(1, buf);
 
-  printf("%s: creating %s (size=%d nentries=%d bootstart=%d)\n",
-    argv[0], argv[1], sfs_sb.size, sfs_sb.nentries, sfs_sb.bootstart);
+  printf("%s: creating %s (size=%d nentries=%d bitmapstart=%d bootstart=%d)\n",
+    argv[0], argv[1], sfs_sb.size, sfs_sb.nentries, sfs_sb.bitmapstart,
+    sfs_sb.bootstart);
 
   // Create empty entries table
   sfs_entry = malloc(entries_size);
@@ -188,7 +192,31 @@ int main(int argc, char *argv[])
     exit(1);
   }
 
+  // Write allocation bitmap
+  // All blocks before the first unused one are in use
+  if(b > fssize_blocks) {
+    fprintf(stderr, "%s: not enough space (%d blocks needed)\n", argv[0], b);
+    exit(1);
+  }
+  bitmap_size = sfs_sb.bitmapblocks * BLOCK_SIZE;
+  bitmap = malloc(bitmap_size);
+  memset(bitmap, 0, bitmap_size);
+  for(i = 0; i < b; i++) {
+    bitmap[i / 8] |= (1 << (i % 8));
+  }
+
+  if(lseek(fsfd, sfs_sb.bitmapstart*BLOCK_SIZE, 0) != sfs_sb.bitmapstart*BLOCK_SIZE) {
+    perror("lseek");
+    exit(1);
+  }
+
+  if(write(fsfd, bitmap, bitmap_size) != bitmap_size) {
+    perror("write");
+    exit(1);
+  }
+
   // Done! Free memory, close file, and exit
+  free(bitmap);
   free(sfs_entry);
   close(fsfd);
 
@@ -5,6 +5,10 @@
 %define STAGE_LOC       0x8000 ; Location of stage
 %define BDISK_LOC       0x0660 ; Location to store boot disk in memory
 
+; Kernel size. Kernel is loaded from STAGE_LOC up to the user
+; programs arguments area (see cli.c), one segment per block
+%define KERNEL_BLOCKS   191
+
 [ORG ORG_LOC]
 [BITS 16]
   jmp  0x0000:start
@@ -43,7 +47,7 @@ start:
   push ax
   call disk_lba_to_hts
 
-  mov  bx, [BUFFER]
+  mov  bx, 0
 
   mov  ah, 2
   mov  al, 1
@@ -69,17 +73,16 @@ start:
   pop  ax
   cmp  ax, 1
   jne  .inc_loop        ; If it was the super block
-  mov  bx, [BUFFER]
-  mov  ax, [es:bx+12]
+  mov  ax, [es:12]
   mov  bx, ax
-  add  bx, 127
+  add  bx, KERNEL_BLOCKS
   mov  [LASTBLOCK], bx
   jmp  .read_next       ; find where the bootable image starts
 .inc_loop:
   inc  ax
-  mov  bx, [BUFFER]
-  add  bx, 512
-  mov  [BUFFER], bx
+  mov  bx, es           ; Next block goes to the next 512 bytes
+  add  bx, 0x20
+  mov  es, bx
   cmp  ax, [LASTBLOCK]
   jne  .read_next
 
@@ -129,7 +132,6 @@ disk_lba_to_hts:
 
 SECTORS   dw 18
 SIDES     dw 2
-BUFFER    dw 0
 LASTBLOCK dw 240
 
 error:
@@ -0,0 +1,423 @@
+// Disk cache
+
+#include "types.h"
+#include "kernel.h"
+#include "hwio.h"
+#include "ulib/ulib.h"
+#include "cache.h"
+
+// See cache.h for a description of the cache policy
+
+// Cached sectors data is stored here, one sector per slot
+#define CACHE_DATA_ADDRESS 0x78000 // Linear memory address
+static uint8_t *cache_data = (uint8_t*)CACHE_DATA_ADDRESS;
+
+typedef struct cache_slot_t {
+  bool  used;      // Slot contains a cached sector
+  bool  dirty;     // Slot data must be written to disk
+  uint  disk;      // Cached disk
+  uint  sector;    // Cached sector
+  uint  last_use;  // Access counter value when slot was last used
+} cache_slot_t;
+
+static cache_slot_t slot[CACHE_NUM_SLOTS];
+static uint access_counter = 0;
+static uint last_sync_time = 0;
+static cache_stats_t stats = {0};
+
+// Cache operations can wait for disk interrupts, and other
+// IRQ handlers may run meanwhile. These must not access the cache,
+// but can defer a function until the current operation finishes
+#define CACHE_MAX_DEFERRED 4
+static uint busy = 0;
+static void (*deferred_func[CACHE_MAX_DEFERRED])() = {NULL};
+
+// Begin a cache operation
+static void begin_op()
+{
+  disable_interrupts();
+  busy++;
+}
+
+// End a cache operation, running the deferred functions if any
+static void end_op()
+{
+  busy--;
+  for(uint i=0; i<CACHE_MAX_DEFERRED && busy==0; i++) {
+    if(deferred_func[i] != NULL) {
+      void (*func)() = deferred_func[i];
+      deferred_func[i] = NULL;
+      func();
+    }
+  }
+  enable_interrupts();
+}
+
+// Get slot data buffer
+static uint8_t *slot_data(uint s)
+{
+  return cache_data + s*DISK_SECTOR_SIZE;
+}
+
+// Write a dirty slot to disk
+// Returns NO_ERROR on success, ERROR_IO otherwise
+static uint write_back(uint s)
+{
+  if(slot[s].used && slot[s].dirty) {
+    // BIOS disk errors are small values, not error codes
+    const uint result = io_disk_write(slot[s].disk, slot[s].sector,
+      0, DISK_SECTOR_SIZE, slot_data(s));
+    if(result != NO_ERROR) {
+      return ERROR_IO;
+    }
+    slot[s].dirty = FALSE;
+    stats.dirty--;
+    stats.writebacks++;
+  }
+  return NO_ERROR;
+}
+
+static uint write_dirty();
+
+// Drop cached sectors of a disk if its media was changed.
+// Dirty sectors belong to the removed media and can't be written
+// Returns NO_ERROR on success, ERROR_IO if dirty sectors were lost
+static uint check_media(uint disk)
+{
+  if(!io_disk_changed(disk)) {
+    return NO_ERROR;
+  }
+
+  uint lost = 0;
+  for(uint s=0; s<CACHE_NUM_SLOTS; s++) {
+    if(slot[s].used && slot[s].disk == disk) {
+      if(slot[s].dirty) {
+        slot[s].dirty = FALSE;
+        stats.dirty--;
+        lost++;
+      }
+      slot[s].used = FALSE;
+    }
+  }
+
+  if(lost > 0) {
+    debug_putstr("cache: disk %u changed. %u sectors not written\n",
+      disk, lost);
+    return ERROR_IO;
+  }
+  return NO_ERROR;
+}
+
+// Write dirty sectors of a disk whose media changes can't be
+// detected, so they are not kept after the current operation
+// Returns NO_ERROR on success, ERROR_IO otherwise
+static uint write_undetectable(uint disk)
+{
+  uint result = NO_ERROR;
+  if(!io_disk_detects_change(disk)) {
+    for(uint s=0; s<CACHE_NUM_SLOTS && result==NO_ERROR; s++) {
+      if(slot[s].disk == disk) {
+        result = write_back(s);
+      }
+    }
+  }
+  return result;
+}
+
+// Find a cached sector. Returns its slot or CACHE_NUM_SLOTS
+static uint find_slot(uint disk, uint sector)
+{
+  for(uint s=0; s<CACHE_NUM_SLOTS; s++) {
+    if(slot[s].used && slot[s].sector == sector && slot[s].disk == disk) {
+      return s;
+    }
+  }
+  return CACHE_NUM_SLOTS;
+}
+
+// Get the slot of a sector, adding it to the cache if needed.
+// Sector contents are read from disk only if load is TRUE
+// Returns slot index or ERROR_IO
+static uint get_slot(uint disk, uint sector, bool load)
+{
+  uint s = find_slot(disk, sector);
+
+  if(s < CACHE_NUM_SLOTS) {
+    stats.hits++;
+  } else {
+    stats.misses++;
+
+    // Replace an unused slot or the least recently used one
+    s = 0;
+    for(uint i=0; i<CACHE_NUM_SLOTS; i++) {
+      if(!slot[i].used) {
+        s = i;
+        break;
+      }
+      if(slot[i].last_use < slot[s].last_use) {
+        s = i;
+      }
+    }
+
+    // Dirty sectors of other disks are written only if
+    // their media didn't change
+    uint result = NO_ERROR;
+    if(slot[s].used && slot[s].dirty && slot[s].disk != disk) {
+      result = check_media(slot[s].disk);
+    }
+    if(result == NO_ERROR) {
+      result = write_back(s);
+    }
+    if(result != NO_ERROR) {
+      return result;
+    }
+    slot[s].used = FALSE;
+
+    if(load) {
+      result = io_disk_read(disk, sector, 0, DISK_SECTOR_SIZE, slot_data(s));
+      if(result != NO_ERROR) {
+        return ERROR_IO;
+      }
+    }
+    slot[s].used = TRUE;
+    slot[s].disk = disk;
+    slot[s].sector = sector;
+  }
+
+  slot[s].last_use = ++access_counter;
+  return s;
+}
+
+// Read disk, specific sector, offset and size
+// Returns NO_ERROR on success, another value otherwise
+uint cache_disk_read(uint disk, uint sector, uint offset, size_t size, void *buff)
+{
+  // Compute initial sector and offset
+  sector += offset / DISK_SECTOR_SIZE;
+  offset = offset % DISK_SECTOR_SIZE;
+
+  begin_op();
+  uint result = check_media(disk);
+
+  while(size > 0 && result == NO_ERROR) {
+    // Big aligned transfers are read directly from disk,
+    // but cached dirty sectors are newer than disk ones
+    if(offset == 0 && size >= CACHE_BYPASS_SECTORS*DISK_SECTOR_SIZE) {
+      const uint n = size / DISK_SECTOR_SIZE;
+      result = io_disk_read(disk, sector, 0, n*DISK_SECTOR_SIZE, buff);
+      for(uint s=0; s<CACHE_NUM_SLOTS && result==NO_ERROR; s++) {
+        if(slot[s].used && slot[s].dirty && slot[s].disk == disk &&
+          slot[s].sector >= sector && slot[s].sector < sector + n) {
+          memcpy(buff + (slot[s].sector-sector)*DISK_SECTOR_SIZE,
+            slot_data(s), DISK_SECTOR_SIZE);
+        }
+      }
+      sector += n;
+      buff += n*DISK_SECTOR_SIZE;
+      size -= n*DISK_SECTOR_SIZE;
+      continue;
+    }
+
+    // Read partial or small transfers through the cache
+    const uint s = get_slot(disk, sector, TRUE);
+    if(s >= ERROR_ANY) {
+      result = s;
+      break;
+    }
+    const uint n = min(DISK_SECTOR_SIZE - offset, size);
+    memcpy(buff, slot_data(s) + offset, n);
+    sector++;
+    offset = 0;
+    buff += n;
+    size -= n;
+  }
+
+  end_op();
+  return result;
+}
+
+// Write disk, specific sector, offset and size
+// Returns NO_ERROR on success, another value otherwise
+uint cache_disk_write(uint disk, uint sector, uint offset, size_t size, const void *buff)
+{
+  // Compute initial sector and offset
+  sector += offset / DISK_SECTOR_SIZE;
+  offset = offset % DISK_SECTOR_SIZE;
+
+  begin_op();
+  uint result = check_media(disk);
+
+  while(size > 0 && result == NO_ERROR) {
+    // Big aligned transfers are written directly to disk.
+    // Cached copies of these sectors are updated
+    if(offset == 0 && size >= CACHE_BYPASS_SECTORS*DISK_SECTOR_SIZE) {
+      const uint n = size / DISK_SECTOR_SIZE;
+      result = io_disk_write(disk, sector, 0, n*DISK_SECTOR_SIZE, buff);
+      for(uint s=0; s<CACHE_NUM_SLOTS && result==NO_ERROR; s++) {
+        if(slot[s].used && slot[s].disk == disk &&
+          slot[s].sector >= sector && slot[s].sector < sector + n) {
+          memcpy(slot_data(s), buff + (slot[s].sector-sector)*DISK_SECTOR_SIZE,
+            DISK_SECTOR_SIZE);
+          if(slot[s].dirty) {
+            slot[s].dirty = FALSE;
+            stats.dirty--;
+          }
+        }
+      }
+      sector += n;
+      buff += n*DISK_SECTOR_SIZE;
+      size -= n*DISK_SECTOR_SIZE;
+      continue;
+    }
+
+    // Write partial or small transfers in the cache.
+    // Sectors only need to be read if they are partially written
+    const uint n = min(DISK_SECTOR_SIZE - offset, size);
+    const uint s = get_slot(disk, sector, n != DISK_SECTOR_SIZE);
+    if(s >= ERROR_ANY) {
+      result = s;
+      break;
+    }
+    memcpy(slot_data(s) + offset, buff, n);
+    if(!slot[s].dirty) {
+      slot[s].dirty = TRUE;
+      stats.dirty++;
+    }
+    sector++;
+    offset = 0;
+    buff += n;
+    size -= n;
+  }
+
+  if(result == NO_ERROR) {
+    result = write_undetectable(disk);
+  }
+
+  // Too many delayed writes, or too much time since last sync
+  if(result == NO_ERROR) {
+    if(io_gettimer() - last_sync_time > CACHE_SYNC_PERIOD) {
+      result = cache_sync();
+    } else if(stats.dirty > CACHE_MAX_DIRTY) {
+      result = write_dirty();
+    }
+  }
+
+  end_op();
+  return result;
+}
+
+// Write all dirty sectors to disk, without flushing disks
+// Returns NO_ERROR on success, another value otherwise
+static uint write_dirty()
+{
+  uint result = NO_ERROR;
+  uint checked_disk = MAX_DISK;
+
+  // Write in disk and sector order, so consecutive
+  // sectors are written sequentially
+  while(stats.dirty > 0 && result == NO_ERROR) {
+    uint first = CACHE_NUM_SLOTS;
+    for(uint s=0; s<CACHE_NUM_SLOTS; s++) {
+      if(slot[s].used && slot[s].dirty && (first == CACHE_NUM_SLOTS ||
+        slot[s].disk < slot[first].disk ||
+        (slot[s].disk == slot[first].disk && slot[s].sector < slot[first].sector))) {
+        first = s;
+      }
+    }
+    if(first == CACHE_NUM_SLOTS) {
+      debug_putstr("cache_sync: error: dirty=%u\n", stats.dirty);
+      stats.dirty = 0;
+      break;
+    }
+    if(slot[first].disk != checked_disk) {
+      checked_disk = slot[first].disk;
+      result = check_media(checked_disk);
+      if(result != NO_ERROR) {
+        break;
+      }
+    }
+    result = write_back(first);
+  }
+
+  return result;
+}
+
+// Write all dirty sectors to disk and flush disks
+// Returns NO_ERROR on success, another value otherwise
+uint cache_sync()
+{
+  begin_op();
+
+  uint result = write_dirty();
+
+  // Write barrier: data is persistent after this
+  for(uint disk=0; disk<MAX_DISK && result==NO_ERROR; disk++) {
+    if(disk_info[disk].size) {
+      result = io_disk_flush(disk);
+    }
+  }
+  if(result == NO_ERROR) {
+    stats.syncs++;
+  }
+  last_sync_time = io_gettimer();
+
+  end_op();
+  return result;
+}
+
+// Return TRUE if a cache operation is in progress
+bool cache_is_busy()
+{
+  return busy > 0;
+}
+
+// Run a function when the current cache operation finishes
+void cache_defer(void (*func)())
+{
+  uint free = CACHE_MAX_DEFERRED;
+  for(uint i=0; i<CACHE_MAX_DEFERRED; i++) {
+    if(deferred_func[i] == func) {
+      return;
+    }
+    if(deferred_func[i] == NULL && free == CACHE_MAX_DEFERRED) {
+      free = i;
+    }
+  }
+  if(free < CACHE_MAX_DEFERRED) {
+    deferred_func[free] = func;
+  } else {
+    debug_putstr("cache_defer: too many deferred functions\n");
+  }
+}
+
+// Sync if too much time passed since the last sync
+static void timer_sync()
+{
+  if(stats.dirty > 0 &&
+    io_gettimer() - last_sync_time > CACHE_SYNC_PERIOD) {
+    cache_sync();
+  }
+}
+
+// Called by the timer handler after acknowledging the interrupt.
+// Dirty sectors are written even if no more writes happen
+void cache_timer()
+{
+  if(stats.dirty == 0 ||
+    io_gettimer() - last_sync_time <= CACHE_SYNC_PERIOD) {
+    return;
+  }
+
+  // The interrupted code could be waiting for a disk
+  if(cache_is_busy()) {
+    cache_defer(timer_sync);
+  } else {
+    timer_sync();
+  }
+}
+
+// Get cache statistics
+void cache_get_stats(cache_stats_t *s)
+{
+  memcpy(s, &stats, sizeof(stats));
+}
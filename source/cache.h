@@ -0,0 +1,68 @@
+// Disk cache
+
+#ifndef _CACHE_H
+#define _CACHE_H
+
+// The disk cache sits between the file system and the disk drivers.
+// It keeps recently used disk sectors in memory, keyed by (disk, sector),
+// and replaces the least recently used one when a new sector is needed.
+//
+// Writes are delayed (write-back): modified sectors are marked as dirty
+// and written to disk when they are replaced, when there are more than
+// CACHE_MAX_DIRTY dirty sectors, or when cache_sync is called.
+//
+// Disks are not asked to flush their own write cache after each write.
+// cache_sync is the write barrier: it writes dirty sectors and flushes
+// disks. It is called at explicit sync points, and by writes and the
+// timer when more than CACHE_SYNC_PERIOD miliseconds passed since the
+// last sync.
+//
+// Transfers of CACHE_BYPASS_SECTORS or more entire sectors go directly
+// to disk, but they are still kept coherent with cached sectors.
+//
+// Cached sectors of removable disks are dropped when a media change
+// is detected. Operations fail if dirty sectors are lost this way.
+// Disks that can't detect changes are not cached between operations.
+
+#define CACHE_NUM_SLOTS      64 // Number of cached sectors
+#define CACHE_MAX_DIRTY      32 // Dirty sectors allowed before a sync
+#define CACHE_BYPASS_SECTORS  4 // Min transfer size to bypass the cache
+#define CACHE_SYNC_PERIOD  5000 // Max miliseconds between syncs
+
+// Read disk, specific sector, offset and size
+// Returns NO_ERROR on success, another value otherwise
+uint cache_disk_read(uint disk, uint sector, uint offset, size_t size, void *buff);
+
+// Write disk, specific sector, offset and size
+// Returns NO_ERROR on success, another value otherwise
+uint cache_disk_write(uint disk, uint sector, uint offset, size_t size, const void *buff);
+
+// Write all dirty sectors to disk and flush disks
+// Returns NO_ERROR on success, another value otherwise
+uint cache_sync();
+
+// Return TRUE if a cache operation is in progress.
+// A cache operation can be interrupted while waiting for the disk.
+// Interrupt handlers must not access the cache in that case
+bool cache_is_busy();
+
+// Run a function when the current cache operation finishes.
+// A few different functions can be deferred
+void cache_defer(void (*func)());
+
+// Sync periodically. Called by the timer handler
+// after acknowledging the interrupt
+void cache_timer();
+
+// Cache statistics
+typedef struct cache_stats_t {
+  uint hits;        // Sector accesses found in cache
+  uint misses;      // Sector accesses not found in cache
+  uint writebacks;  // Dirty sectors written to disk
+  uint dirty;       // Current number of dirty sectors
+  uint syncs;       // Completed syncs (write barriers)
+} cache_stats_t;
+
+void cache_get_stats(cache_stats_t *stats);
+
+#endif // _CACHE_H
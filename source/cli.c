@@ -6,16 +6,18 @@
 #include "hwio.h"
 #include "ulib/ulib.h"
 #include "fs.h"
+#include "cache.h"
 #include "x86.h"
 #include "net.h"
 #include "sound.h"
 #include "cli.h"
+#include "heap.h"
 
 // Extern program call
 #define UPROG_MEMLOC 0x20000
 #define UPROG_MEMMAX 0x10000
-#define UPROG_ARGLOC 0x18000
-#define UPROG_STRLOC 0x18080
+#define UPROG_ARGLOC 0x1FE00
+#define UPROG_STRLOC 0x1FE80
 
 // Built-in commands implementation
 
@@ -34,6 +36,7 @@ static void cli_shutdown(uint argc)
 {
   if(argc == 1) {
     putstr("Shutting down...\n\n");
+    cache_sync();
     io_vga_clear();
     io_vga_showcursor(0);
     putstr("Turn off computer");
@@ -197,11 +200,36 @@ static void cli_info(uint argc)
     putstr("\n");
     putstr("System disk: %s\n", disk_to_string(system_disk));
 
+    cache_stats_t cstats;
+    cache_get_stats(&cstats);
+    putstr("Disk cache: %u hits, %u misses, %u writebacks, %u dirty, %u syncs\n",
+      cstats.hits, cstats.misses, cstats.writebacks, cstats.dirty, cstats.syncs);
+
+    putstr("Memory: %uKB extended memory\n", io_mem_get_extended()/1024);
+
+    // Fragmentation: free memory not in the largest free block
+    heap_stats_t hstats;
+    heap_get_stats(&hstats);
+    putstr("Heap: %uKB used, %uKB free (largest %uKB, %u percent fragmented)\n",
+      hstats.used/1024, hstats.free/1024, hstats.largest/1024,
+      hstats.free ? 100-(hstats.largest*100)/hstats.free : 0);
+    putstr("      %u allocs, %u slab pages, %u failed allocs\n",
+      hstats.allocs, hstats.slab_pages, hstats.failed);
+
     const uint net_state = io_net_get_state();
     putstr("Network state: %s\n",
       net_state == NET_STATE_ENABLED ? "enabled" :
       net_state == NET_STATE_DISABLED ? "disabled" :
       "uninitialized");
+    net_stats_t nstats;
+    io_net_get_stats(&nstats);
+    putstr("Network reception: %u queued, %u dropped, %u unbound, %u overruns, %u errors\n",
+      nstats.rx_queued, nstats.rx_dropped, nstats.rx_unbound,
+      nstats.rx_overruns, nstats.rx_errors);
+    putstr("Network ARP: %u queued, %u unresolved\n",
+      nstats.tx_arp_queued, nstats.tx_unresolved);
+    putstr("Network transmission: %u packets, %u cycles per packet\n",
+      nstats.tx_packets, nstats.tx_cycles);
     putstr("Sound state: %s\n",
       io_sound_is_enabled() ? "enabled" : "disabled");
     putstr("\n");
@@ -211,6 +239,18 @@ static void cli_info(uint argc)
   }
 }
 
+// Write delayed disk writes
+static void cli_sync(uint argc)
+{
+  if(argc == 1) {
+    if(cache_sync() != NO_ERROR) {
+      putstr("error: disk sync failed\n");
+    }
+  } else {
+    putstr("usage: sync\n");
+  }
+}
+
 // Clone system disk in another disk
 static void cli_clone(uint argc, char *argv[])
 {
@@ -303,11 +343,11 @@ static void cli_read(uint argc, char *argv[])
 {
   if(argc==2 || (argc==3 && strcmp(argv[1],"hex")==0)) {
     uint result = 0;
-    uint offset = 0;
     char buff[512] = {0};
     memset(buff, 0, sizeof(buff));
+    const uint handle = fs_open(argv[argc-1], 0);
     // While it can read the file, print it
-    while((result = fs_read_file(buff, argv[argc-1], offset, sizeof(buff)))) {
+    while((result = fs_read(handle, buff, sizeof(buff)))) {
       if(result == ERROR_NOT_FOUND) {
         putstr("\nInvalid input file\n");
         break;
@@ -315,10 +355,10 @@ static void cli_read(uint argc, char *argv[])
         putstr("\nThere was an error reading input file\n");
         break;
       }
-      for(uint i=0; i<result; i++) {
-        if(argc==2) {
-          putc(buff[i]);
-        } else {
+      if(argc==2) {
+        putbuff(buff, result);
+      } else {
+        for(uint i=0; i<result; i++) {
           const uint uc = (uint8_t)buff[i];
           putstr("%2x ", uc);
           debug_putstr("%2x ", uc);
@@ -328,8 +368,8 @@ static void cli_read(uint argc, char *argv[])
         }
       }
       memset(buff, 0, sizeof(buff));
-      offset += result;
     }
+    fs_close(handle);
     fs_print_map(argv[argc-1]);
     putstr("\n");
   } else if(argc==3 && strcmp(argv[1],"map")==0) {
@@ -464,6 +504,10 @@ static void cli_extern(uint argc, char *argv[])
 
     // Run program
     user_prog(argc, (void*)UPROG_ARGLOC);
+
+    // Close files and sockets left open by the program
+    fs_close_user_files();
+    io_net_unbind_user_ports();
   }
 }
 
@@ -533,6 +577,10 @@ static void execute(char *str)
     // Read (display) file contents
     cli_read(argc, argv);
 
+  } else if(strcmp(argv[0], "sync") == 0) {
+    // Write delayed disk writes
+    cli_sync(argc);
+
   } else if(strcmp(argv[0], "time") == 0) {
     // Show time and date
     cli_time(argc);
@@ -559,6 +607,7 @@ static void execute(char *str)
       putstr("move     - move file or directory\n");
       putstr("read     - show file contents in screen\n");
       putstr("shutdown - shutdown the computer\n");
+      putstr("sync     - write delayed disk writes\n");
       putstr("time     - show time and date\n");
       putstr("\n");
     } else if(argc == 2 && strcmp(argv[1], "huri") == 0) {
@@ -595,14 +644,21 @@ void cli_exec_file(char *path)
   char line[72] = {0};
   uint offset = 0;
 
+  const uint handle = fs_open(path, 0);
+  if(handle >= ERROR_ANY) {
+    debug_putstr("CLI: Open file (%s) error %x\n", path, handle);
+    return;
+  }
+
   while(1) {
     // Read file
-    const uint readed = fs_read_file(line, path, offset, sizeof(line));
+    fs_seek(handle, offset);
+    const uint readed = fs_read(handle, line, sizeof(line));
 
     if(readed==0 || readed>=ERROR_ANY) {
       debug_putstr("CLI: Read file (%s) error %x\n",
       path, readed);
-      return;
+      break;
     }
 
     // Isolate a line
@@ -617,12 +673,14 @@ void cli_exec_file(char *path)
 
     // Escape if lines are too long
     if(i==readed) {
-      return;
+      break;
     }
 
     // Run line
     execute(line);
   }
+
+  fs_close(handle);
 }
 
 
@@ -638,5 +696,8 @@ void cli()
 
     // Execute
     execute(str);
+
+    // Write delayed disk writes
+    cache_sync();
   }
 }
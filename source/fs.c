@@ -4,6 +4,7 @@
 #include "kernel.h"
 #include "hwio.h"
 #include "ulib/ulib.h"
+#include "cache.h"
 #include "fs.h"
 
 // See fs.h for more detailed description
@@ -82,7 +83,7 @@ static uint read_disk(uint disk, uint block, uint offset, size_t size, void *buf
   sector += offset / DISK_SECTOR_SIZE;
   offset = offset % DISK_SECTOR_SIZE;
 
-  return io_disk_read(disk, sector, offset, size, buff);
+  return cache_disk_read(disk, sector, offset, size, buff);
 }
 
 // Write disk, specific sector, offset and size
@@ -96,7 +97,7 @@ static uint write_disk(uint disk, uint block, uint offset, size_t size, const vo
   sector += offset / DISK_SECTOR_SIZE;
   offset = offset % DISK_SECTOR_SIZE;
 
-  return io_disk_write(disk, sector, offset, size, buff);
+  return cache_disk_write(disk, sector, offset, size, buff);
 }
 
 // Get filesystem info
@@ -246,6 +247,41 @@ static uint get_entry_n(sfs_entry_t *entry, uint disk, size_t n)
   return result != NO_ERROR ? ERROR_IO : n;
 }
 
+// Directory entries cache
+// Maps (disk, parent, name) to an entry index, so resolving known
+// names does not require walking the parent directory references.
+// Cached indices are always validated against the entry read from disk
+#define DENTRY_CACHE_SIZE 32 // Must be a power of 2
+
+typedef struct dentry_t {
+  uint  disk;
+  uint  parent;
+  uint  nentry;              // Entry index, 0 if unused
+  char  name[SFS_NAMESIZE];
+} dentry_t;
+
+static dentry_t dentry_cache[DENTRY_CACHE_SIZE];
+
+// Get dentry cache slot for a given disk, parent and name
+static dentry_t *dentry_slot(uint disk, uint parent, const char *name)
+{
+  uint hash = disk*31 + parent;
+  while(*name) {
+    hash = hash*31 + (uint8_t)*name++;
+  }
+  return &dentry_cache[hash & (DENTRY_CACHE_SIZE-1)];
+}
+
+// Remove all cached dentries of a disk
+static void dentry_invalidate(uint disk)
+{
+  for(uint i=0; i<DENTRY_CACHE_SIZE; i++) {
+    if(dentry_cache[i].disk == disk) {
+      dentry_cache[i].nentry = 0;
+    }
+  }
+}
+
 // Get an entry given a path, parent and disk
 uint fs_get_entry(sfs_entry_t *entry, char *path, uint parent, uint disk)
 {
@@ -276,25 +312,59 @@ uint fs_get_entry(sfs_entry_t *entry, char *path, uint parent, uint disk)
     path = name;
   }
 
-  // Read superblock
-  sfs_superblock_t sb;
-  result = read_disk(disk, 1, 0, sizeof(sb), (void*)&sb);
-  if(result != NO_ERROR) {
-    return ERROR_IO;
+  // Root directory is not referenced by any directory
+  if(parent == 0 && !strcmp(path, ROOT_DIR_NAME)) {
+    return get_entry_n(entry, disk, 0);
   }
 
-  // Check all entries
-  uint n = 0;
-  while(n < sb.nentries) {
-    result = get_entry_n(entry, disk, n);
+  // Check dentry cache
+  dentry_t *dentry = dentry_slot(disk, parent, path);
+  if(dentry->nentry != 0 && dentry->disk == disk && dentry->parent == parent &&
+    !strcmp(dentry->name, path)) {
+    result = get_entry_n(entry, disk, dentry->nentry);
     if(result >= ERROR_ANY) {
       return result;
     }
     if((entry->flags & F_USED) && entry->parent == parent &&
       !strcmp((char*)entry->name, path)) {
+      return result;
+    }
+    dentry->nentry = 0;
+  }
+
+  // Get parent directory
+  sfs_entry_t direntry;
+  result = get_entry_n(&direntry, disk, parent);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
+  if(!(direntry.flags & T_DIR)) {
+    return ERROR_NOT_FOUND;
+  }
+
+  // Check all entries referenced by parent
+  const uint refcount = direntry.size;
+  for(uint r=0; r<refcount; r++) {
+    // Advance to next chained entry if needed
+    if(r > 0 && r % SFS_ENTRYREFS == 0) {
+      result = get_entry_n(&direntry, disk, direntry.next);
+      if(result >= ERROR_ANY) {
+        return result;
+      }
+    }
+    const uint n = direntry.ref[r % SFS_ENTRYREFS];
+    result = get_entry_n(entry, disk, n);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+    if((entry->flags & F_USED) && !strcmp((char*)entry->name, path)) {
+      // Found: add to dentry cache
+      dentry->disk = disk;
+      dentry->parent = parent;
+      dentry->nentry = n;
+      strncpy(dentry->name, path, sizeof(dentry->name));
       return n;
     }
-    n++;
   }
 
   return ERROR_NOT_FOUND;
@@ -333,55 +403,164 @@ static uint get_nref_entry_from_entry(sfs_entry_t *outentry,
   return result;
 }
 
-// Read file in buff, given path, offset and count
-uint fs_read_file(void *buff, char *path, uint offset, size_t count)
+// Position inside the chain of entries of a file
+// Used to avoid walking the chain from the head entry on sequential accesses
+typedef struct chain_pos_t {
+  uint nentry;  // Index of a chained entry, or 0 if unknown
+  uint nref;    // Index of its first reference in the whole chain
+} chain_pos_t;
+
+// Open files table
+typedef struct open_file_t {
+  bool        used;
+  uint        disk;
+  uint        nentry;   // Head entry index
+  uint        offset;   // Current position
+  uint        flags;    // Open flags
+  chain_pos_t pos;      // Last accessed chained entry
+  uint        generation; // Changed on each open, part of the handle
+} open_file_t;
+
+// Handles are an open_file index and its generation, so handles
+// of closed files are not valid even if the index is reused
+#define FS_HANDLE_GENERATIONS 0x10000
+
+static open_file_t open_file[FS_MAX_OPEN_FILES] = {0};
+
+// Forget known chain positions of a disk
+// Must be called when chained entries are deleted
+static void reset_chain_pos(uint disk)
 {
-  debug_putstr("fs_read_file %x %s %u %u\n", buff, path, offset, count);
+  for(uint h=0; h<FS_MAX_OPEN_FILES; h++) {
+    if(open_file[h].disk == disk) {
+      open_file[h].pos.nentry = 0;
+    }
+  }
+}
+
+// Close open files of an entry
+// Must be called when the entry is deleted
+static void close_entry_files(uint disk, uint nentry)
+{
+  for(uint h=0; h<FS_MAX_OPEN_FILES; h++) {
+    if(open_file[h].used && open_file[h].disk == disk &&
+      open_file[h].nentry == nentry) {
+      open_file[h].used = FALSE;
+    }
+  }
+}
+
+// Same as get_nref_entry_from_entry, but the chain walk starts at
+// pos if it's known and not after the requested reference.
+// pos is updated to the found chained entry
+static uint get_nref_entry_from_pos(sfs_entry_t *outentry,
+  sfs_entry_t *entry, uint disk, uint nentry, uint nref, chain_pos_t *pos)
+{
+  uint result = 0;
+  if(pos->nentry != 0 && pos->nref <= nref) {
+    result = get_entry_n(outentry, disk, pos->nentry);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+    result = get_nref_entry_from_entry(outentry, outentry, disk,
+      pos->nentry, nref - pos->nref);
+  } else {
+    result = get_nref_entry_from_entry(outentry, entry, disk, nentry, nref);
+  }
+
+  if(result < ERROR_ANY) {
+    pos->nentry = result;
+    pos->nref = nref - nref % SFS_ENTRYREFS;
+  }
+  return result;
+}
+
+// Read file in buff, given its head entry, offset and count
+// Returns number of read bytes or an error code
+static uint read_file_n(void *buff, uint disk, uint nentry, sfs_entry_t *entry,
+  uint offset, size_t count, chain_pos_t *pos)
+{
+  // Compute initial block and offset
+  offset = min(offset, entry->size);
+  count = min(count, entry->size - offset);
+  uint block = offset / BLOCK_SIZE;
+  offset = offset % BLOCK_SIZE;
+  uint read = 0;
+
+  // Runs of contiguous blocks are read at once, even if their
+  // references are in different chained entries.
+  // A run is read when the next block is not contiguous
+  uint run_ref = 0;     // First block of the pending run
+  uint run_blocks = 0;  // Number of blocks in the pending run
+  uint run_offset = 0;  // Offset inside its first block
+  size_t run_size = 0;  // Number of bytes to read
   uint result = NO_ERROR;
 
-  // Find entry
-  sfs_entry_t entry;
   sfs_entry_t tentry;
-  uint nentry = fs_get_entry(&entry, path, UNKNOWN_VALUE, UNKNOWN_VALUE);
-  if(nentry < ERROR_ANY && (entry.flags & T_FILE)) {
-    // Compute initial block and offset
-    offset = min(offset, entry.size);
-    count = min(count, entry.size - offset);
-    uint block = offset / BLOCK_SIZE;
-    offset = offset % BLOCK_SIZE;
-    const uint disk = path_get_disk(path);
-    uint read = 0;
-    uint ntentry = nentry;
-    while(read < count) {
-      // Get chained entry for a given reference index number
-      ntentry = get_nref_entry_from_entry(&tentry, &entry, disk, nentry, block);
-      if(ntentry >= ERROR_ANY) {
-        return ntentry;
-      }
-
-      // Read in buffer
-      const size_t n = min(BLOCK_SIZE-offset, count-read);
-      result = read_disk(disk, tentry.ref[block % SFS_ENTRYREFS], offset,
-        n, buff + read);
+  while(read < count) {
+    // Get chained entry for a given reference index number
+    const uint ntentry = get_nref_entry_from_pos(&tentry, entry, disk,
+      nentry, block, pos);
+    if(ntentry >= ERROR_ANY) {
+      return ntentry;
+    }
 
-      if(result != NO_ERROR) {
-        return ERROR_IO;
+    // Add blocks referenced by this chained entry to runs
+    do {
+      const uint ref = tentry.ref[block % SFS_ENTRYREFS];
+      if(run_blocks == 0 || ref != run_ref + run_blocks) {
+        if(run_blocks != 0) {
+          result = read_disk(disk, run_ref, run_offset, run_size,
+            buff + read - run_size);
+          if(result != NO_ERROR) {
+            return ERROR_IO;
+          }
+        }
+        run_ref = ref;
+        run_blocks = 0;
+        run_offset = offset;
+        run_size = 0;
       }
 
+      const size_t n = min(BLOCK_SIZE-offset, count-read);
+      run_blocks++;
+      run_size += n;
       read += n;
       block++;
       offset = 0;
-    }
-    result = read;
-  } else {
-    if(nentry < ERROR_ANY) {
-      result = ERROR_NOT_FOUND;
-    } else {
-      result = nentry;
+    } while(read < count && block % SFS_ENTRYREFS != 0);
+  }
+
+  // Read the last run
+  if(run_blocks != 0) {
+    result = read_disk(disk, run_ref, run_offset, run_size,
+      buff + read - run_size);
+    if(result != NO_ERROR) {
+      return ERROR_IO;
     }
   }
 
-  return result;
+  return read;
+}
+
+// Read file in buff, given path, offset and count
+uint fs_read_file(void *buff, char *path, uint offset, size_t count)
+{
+  debug_putstr("fs_read_file %x %s %u %u\n", buff, path, offset, count);
+
+  // Find entry
+  sfs_entry_t entry;
+  const uint nentry = fs_get_entry(&entry, path, UNKNOWN_VALUE, UNKNOWN_VALUE);
+  if(nentry >= ERROR_ANY) {
+    return nentry;
+  }
+  if(!(entry.flags & T_FILE)) {
+    return ERROR_NOT_FOUND;
+  }
+
+  chain_pos_t pos = {0};
+  return read_file_n(buff, path_get_disk(path), nentry, &entry,
+    offset, count, &pos);
 }
 
 // Write entry by index at disk
@@ -467,31 +646,57 @@ static size_t needed_blocks(size_t size)
   return nblocks;
 }
 
-// Find first free block at disk
-// Return its index or ERROR_NOT_FOUND
-static uint find_free_block(uint disk)
+// Allocation hint: for each disk, block index where
+// the search of the next free block starts
+static uint alloc_hint[MAX_DISK] = {0};
+
+// Set (used) or clear (free) a block bit in the allocation bitmap
+// Disk must have an allocation bitmap
+// Returns NO_ERROR on success, another value otherwise
+static uint set_block_used(uint disk, const sfs_superblock_t *sb, uint block, bool used)
 {
-  // Read superblock
-  sfs_superblock_t sb;
-  uint result = read_disk(disk, 1, 0, sizeof(sb), &sb);
+  if(block >= sb->size) {
+    debug_putstr("set_block_used: error: block=%u size=%u\n", block, sb->size);
+    return ERROR_IO;
+  }
+
+  // Read bitmap byte, update bit and write
+  const uint bblock = sb->bitmapstart + block / SFS_BITMAPBITS;
+  const uint offset = (block % SFS_BITMAPBITS) / 8;
+  uint8_t bits = 0;
+  uint result = read_disk(disk, bblock, offset, sizeof(bits), &bits);
   if(result != NO_ERROR) {
     return ERROR_IO;
   }
+  if(used) {
+    bits |= (1 << (block % 8));
+  } else {
+    bits &= ~(1 << (block % 8));
+  }
+  result = write_disk(disk, bblock, offset, sizeof(bits), &bits);
+
+  return result != NO_ERROR ? ERROR_IO : NO_ERROR;
+}
 
+// Find first free block at disk by scanning all entries references
+// Used when disk has no allocation bitmap
+// Return its index or ERROR_NO_SPACE
+static uint scan_free_block(uint disk, const sfs_superblock_t *sb)
+{
   // Compute first data block index
   const uint first_data_block = 2 +
-    (sb.nentries*sizeof(sfs_entry_t))/BLOCK_SIZE;
+    (sb->nentries*sizeof(sfs_entry_t))/BLOCK_SIZE;
 
-  const uint max_blocks = sb.size;
+  const uint max_blocks = sb->size;
 
   // For each possible block index
   for(uint free_block=first_data_block; free_block<max_blocks; free_block++) {
     // Check if there is an entry referencing it
     uint found = 0;
     uint n = 0;
-    while(found == 0 && n < sb.nentries) {
+    while(found == 0 && n < sb->nentries) {
       sfs_entry_t entry;
-      result = get_entry_n(&entry, disk, n);
+      uint result = get_entry_n(&entry, disk, n);
       if(result >= ERROR_ANY) {
         return result;
       }
@@ -513,10 +718,137 @@ static uint find_free_block(uint disk)
     }
   }
 
-  debug_putstr("find_free_block: error: no space\n");
+  debug_putstr("scan_free_block: error: no space\n");
   return ERROR_NO_SPACE;
 }
 
+// Find a run of contiguous free blocks at disk and mark them as used.
+// If goal block is free, the run starts there, so files can grow
+// contiguously. Otherwise, the first run of wanted blocks found after
+// goal (or after the allocation hint if goal is 0) is used, or the
+// longest one if there is not any run so long.
+// Output: count, number of blocks in the run (1 to wanted)
+// Return index of the first block or ERROR_NO_SPACE
+static uint find_free_run(uint disk, uint goal, uint wanted, uint *count)
+{
+  // Read superblock
+  sfs_superblock_t sb;
+  uint result = read_disk(disk, 1, 0, sizeof(sb), &sb);
+  if(result != NO_ERROR) {
+    return ERROR_IO;
+  }
+
+  // Fallback to entries scan if there is no bitmap
+  if(sb.bitmapstart == 0) {
+    *count = 1;
+    return scan_free_block(disk, &sb);
+  }
+
+  // Search bitmap starting at goal or the allocation hint.
+  // Wrap around once to check also blocks before it
+  const uint start = goal ? goal : alloc_hint[disk];
+  uint block = start < sb.size ? start : 0;
+  uint checked = 0;
+  uint run_start = 0, run = 0;
+  uint best_start = 0, best = 0;
+  bool done = FALSE;
+  while(checked < sb.size && !done) {
+    // Read the bitmap block containing this block bit
+    uint8_t bits[BLOCK_SIZE];
+    const uint bblock = sb.bitmapstart + block / SFS_BITMAPBITS;
+    result = read_disk(disk, bblock, 0, sizeof(bits), bits);
+    if(result != NO_ERROR) {
+      return ERROR_IO;
+    }
+
+    // Check its bits, skipping full bytes
+    const uint end = min(sb.size, (block / SFS_BITMAPBITS + 1) * SFS_BITMAPBITS);
+    while(block < end && !done) {
+      const uint i = block % SFS_BITMAPBITS;
+      if(bits[i / 8] & (1 << (i % 8))) {
+        // A run finishes. A run starting at goal is accepted
+        // even if it's short
+        done = (goal != 0 && run > 0 && run_start == goal);
+        run = 0;
+        const uint skip = bits[i / 8] == 0xFF ? 8 - (i % 8) : 1;
+        checked += skip;
+        block += skip;
+      } else {
+        if(run == 0) {
+          run_start = block;
+        }
+        run++;
+        if(run > best) {
+          best_start = run_start;
+          best = run;
+        }
+        done = (best >= wanted);
+        checked++;
+        block++;
+      }
+    }
+    if(block >= sb.size) {
+      // Runs can not wrap around
+      block = 0;
+      run = 0;
+    }
+  }
+
+  if(best == 0) {
+    debug_putstr("find_free_run: error: no space\n");
+    return ERROR_NO_SPACE;
+  }
+
+  // Mark as used
+  for(uint b=best_start; b<best_start+best; b++) {
+    result = set_block_used(disk, &sb, b, TRUE);
+    if(result != NO_ERROR) {
+      return result;
+    }
+  }
+  if(goal == 0 || (alloc_hint[disk] >= best_start &&
+    alloc_hint[disk] < best_start + best)) {
+    alloc_hint[disk] = best_start + best;
+  }
+
+  *count = best;
+  return best_start;
+}
+
+// Set to 0 the references of entry starting at index first
+// If it's a file entry, referenced data blocks are also marked
+// as free in the allocation bitmap. Entry is not written
+static uint release_entry_refs(uint disk, sfs_entry_t *entry, uint first)
+{
+  if(entry->flags & T_FILE) {
+    // Read superblock
+    sfs_superblock_t sb;
+    uint result = read_disk(disk, 1, 0, sizeof(sb), &sb);
+    if(result != NO_ERROR) {
+      return ERROR_IO;
+    }
+
+    // Free blocks
+    if(sb.bitmapstart != 0) {
+      for(uint i=first; i<SFS_ENTRYREFS; i++) {
+        if(entry->ref[i] != 0) {
+          result = set_block_used(disk, &sb, entry->ref[i], FALSE);
+          if(result != NO_ERROR) {
+            return result;
+          }
+          alloc_hint[disk] = min(alloc_hint[disk], entry->ref[i]);
+        }
+      }
+    }
+  }
+
+  for(uint i=first; i<SFS_ENTRYREFS; i++) {
+    entry->ref[i] = 0;
+  }
+
+  return NO_ERROR;
+}
+
 // Set references count in an entry
 //
 // Given an initial entry index, this function creates new chained entries
@@ -567,9 +899,10 @@ static uint set_entry_refcount(uint disk, uint nentry, uint refcount)
   }
 
   // Set to 0 unused references of last chained entry
-  const uint first_unused = min(SFS_ENTRYREFS-1,refcount)%SFS_ENTRYREFS;
-  for(uint i=first_unused; i<SFS_ENTRYREFS; i++) {
-    entry.ref[i] = 0;
+  const uint first_unused = refcount ? (refcount-1)%SFS_ENTRYREFS + 1 : 0;
+  result = release_entry_refs(disk, &entry, first_unused);
+  if(result >= ERROR_ANY) {
+    return result;
   }
   result = write_entry(&entry, disk, nentry);
   if(result >= ERROR_ANY) {
@@ -578,6 +911,7 @@ static uint set_entry_refcount(uint disk, uint nentry, uint refcount)
 
   // Delete remaining chained entries
   if(entry.next) {
+    reset_chain_pos(disk);
     uint current = nentry;
     uint next = entry.next;
     entry.next = 0;
@@ -591,6 +925,10 @@ static uint set_entry_refcount(uint disk, uint nentry, uint refcount)
         return current;
       }
       next = entry.next;
+      result = release_entry_refs(disk, &entry, 0);
+      if(result >= ERROR_ANY) {
+        return result;
+      }
       memset(&entry, 0, sizeof(entry));
       result = write_entry(&entry, disk, current);
       if(result >= ERROR_ANY) {
@@ -773,14 +1111,57 @@ static uint remove_ref_in_entry(uint disk, uint nentry, uint ref)
   return NO_ERROR;
 }
 
-// Write buff to file given path, offset, count and flags
-uint fs_write_file(const void *buff, char *path, uint offset, size_t count, uint flags)
+// Create an empty file or directory entry given its disk, parent and name
+// flags must be T_FILE or T_DIR
+// Returns the index of the created entry or an error code
+static uint create_entry(sfs_entry_t *entry, uint disk, uint parent,
+  const char *name, uint8_t flags)
 {
-  debug_putstr("fs_write_file %x %s %u %u\n", buff, path, offset, count);
+  // Find a free entry index
+  const uint nentry = find_free_entry(disk);
+  if(nentry >= ERROR_ANY) {
+    return nentry;
+  }
+  dentry_invalidate(disk);
+
+  // Create entry
+  memset(entry, 0, sizeof(sfs_entry_t));
+  strncpy((char*)entry->name, name, SFS_NAMESIZE);
+  entry->size = 0;
+  entry->flags = flags;
+  entry->parent = parent;
+  entry->next = 0;
+  uint result = write_entry(entry, disk, nentry);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
+
+  // Update modified time
+  result = set_entry_time_to_current(disk, nentry);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
+
+  // Add reference in parent
+  if(nentry != entry->parent) {
+    result = add_ref_in_entry(disk, entry->parent, nentry);
+    if(result >= ERROR_ANY) {
+      return result;
+    }
+  }
+
+  return nentry;
+}
 
+// Find a file given its path. If it does not exist and
+// WF_CREATE is set in flags, create it
+// Output: disk
+// Returns the file head entry index or an error code
+static uint find_or_create_file(char *path, uint flags, uint *disk)
+{
   // Find file
   sfs_entry_t entry;
-  uint nentry = fs_get_entry(&entry, path, UNKNOWN_VALUE, UNKNOWN_VALUE);
+  const uint nentry = fs_get_entry(&entry, path, UNKNOWN_VALUE, UNKNOWN_VALUE);
 
   // Does not exist and should not create or it's a directory: return
   if((nentry == ERROR_NOT_FOUND && !(flags & WF_CREATE)) ||
@@ -791,48 +1172,39 @@ uint fs_write_file(const void *buff, char *path, uint offset, size_t count, uint
     return ERROR_NOT_FOUND;
   }
 
-  // Create file if needed
-  uint result = NO_ERROR;
-  uint disk = path_get_disk(path);
-  if(nentry == ERROR_NOT_FOUND && (flags & WF_CREATE)) {
-    uint parent = 0;
-    memset(&entry, 0, sizeof(entry));
-
-    // Parse parent, disk and name
-    result = path_parse_disk_parent_name(&path, &parent, &disk, path);
-    if(result >= ERROR_ANY) {
-      return result;
-    }
+  *disk = path_get_disk(path);
+  if(nentry < ERROR_ANY) {
+    return nentry;
+  }
 
-    // Make name a valid name
-    path = string_to_name(path);
+  // Create file: parse parent, disk and name
+  uint parent = 0;
+  const uint result = path_parse_disk_parent_name(&path, &parent, disk, path);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
 
-    // Fill entry data
-    nentry = find_free_entry(disk);
-    if(nentry >= ERROR_ANY) {
-      return nentry;
-    }
-    entry.size = 0;
-    entry.next = 0;
-    entry.parent = parent;
-    entry.flags = T_FILE;
-    strncpy((char*)entry.name, path, SFS_NAMESIZE);
-    result = write_entry(&entry, disk, nentry);
-    if(result >= ERROR_ANY) {
-      return result;
-    }
+  return create_entry(&entry, *disk, parent, string_to_name(path), T_FILE);
+}
 
-    // Add reference in parent
-    result = add_ref_in_entry(disk, entry.parent, nentry);
-    if(result >= ERROR_ANY) {
-      return result;
-    }
+// Write buff to file given its head entry, offset, count and flags
+// Returns number of written bytes or an error code
+static uint write_file_n(const void *buff, uint disk, uint nentry,
+  uint offset, size_t count, uint flags, chain_pos_t *pos)
+{
+  sfs_entry_t entry;
+  uint result = get_entry_n(&entry, disk, nentry);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
+  if(!(entry.flags & T_FILE)) {
+    return ERROR_NOT_FOUND;
   }
 
   // Resize: grow if needed
   if(entry.size < offset + count) {
     uint current_num_blocks = needed_blocks(entry.size);
-    uint required_num_blocks = needed_blocks(offset + count);
+    const uint required_num_blocks = needed_blocks(offset + count);
 
     // Set reference count and size in the chain
     result = set_entry_refcount(disk, nentry, required_num_blocks);
@@ -844,35 +1216,55 @@ uint fs_write_file(const void *buff, char *path, uint offset, size_t count, uint
       return result;
     }
 
-    // Allocate blocks
+    // Get the chained entry of the last used reference, if any,
+    // so new blocks can be allocated right after it
     sfs_entry_t tentry;
     result = get_entry_n(&tentry, disk, nentry);
     if(result >= ERROR_ANY) {
       return result;
     }
-    uint ntentry = nentry;
-
-    for(; current_num_blocks < required_num_blocks; current_num_blocks++) {
-      while(current_num_blocks >= SFS_ENTRYREFS) {
-        result = write_entry(&tentry, disk, ntentry);
-        if(result >= ERROR_ANY) {
-          return result;
-        }
-        ntentry = get_entry_n(&tentry, disk, tentry.next);
-        if(ntentry >= ERROR_ANY) {
-          return ntentry;
+    uint last = current_num_blocks ? current_num_blocks - 1 : 0;
+    uint ntentry = get_nref_entry_from_entry(&tentry, &tentry, disk,
+      nentry, last);
+    if(ntentry >= ERROR_ANY) {
+      return ntentry;
+    }
+    uint first_ref = last - last % SFS_ENTRYREFS;
+    uint goal = current_num_blocks ?
+      tentry.ref[last % SFS_ENTRYREFS] + 1 : 0;
+
+    // Allocate blocks in runs of contiguous blocks
+    while(current_num_blocks < required_num_blocks) {
+      uint run = 0;
+      const uint block = find_free_run(disk, goal,
+        required_num_blocks - current_num_blocks, &run);
+      if(block >= ERROR_ANY) {
+        return block;
+      }
+      for(uint b=block; b<block+run; b++) {
+        // Advance to the next chained entry if needed
+        if(current_num_blocks - first_ref >= SFS_ENTRYREFS) {
+          result = write_entry(&tentry, disk, ntentry);
+          if(result >= ERROR_ANY) {
+            return result;
+          }
+          ntentry = get_entry_n(&tentry, disk, tentry.next);
+          if(ntentry >= ERROR_ANY) {
+            return ntentry;
+          }
+          first_ref += SFS_ENTRYREFS;
         }
-        current_num_blocks -= SFS_ENTRYREFS;
-        required_num_blocks -= SFS_ENTRYREFS;
+        tentry.ref[current_num_blocks - first_ref] = b;
+        current_num_blocks++;
       }
-      tentry.ref[current_num_blocks] = find_free_block(disk);
-      if(tentry.ref[current_num_blocks] >= ERROR_ANY) {
-        return tentry.ref[current_num_blocks];
+
+      // Update entry now, so disks without allocation bitmap
+      // see these blocks as used
+      result = write_entry(&tentry, disk, ntentry);
+      if(result >= ERROR_ANY) {
+        return result;
       }
-    }
-    result = write_entry(&tentry, disk, ntentry);
-    if(result >= ERROR_ANY) {
-      return result;
+      goal = block + run;
     }
     result = get_entry_n(&entry, disk, nentry);
     if(result >= ERROR_ANY) {
@@ -896,39 +1288,66 @@ uint fs_write_file(const void *buff, char *path, uint offset, size_t count, uint
     }
   }
 
-  // Now file has the right size: write data
+  // Now file has the right size: write data.
+  // Runs of contiguous blocks are written at once, even if their
+  // references are in different chained entries
+  uint block = offset / BLOCK_SIZE;
+  offset = offset % BLOCK_SIZE;
   uint written = 0;
-  while(count > 0) {
-    uint to_copy = min(count, BLOCK_SIZE - (offset % BLOCK_SIZE));
-    uint current_block = needed_blocks(offset+1) - 1;
-    while(current_block >= SFS_ENTRYREFS) {
-      if(entry.next == 0) {
-        debug_putstr("fs_write_file error: current_block=%u entry.next=%u\n",
-          current_block, entry.next);
+  uint run_ref = 0;     // First block of the pending run
+  uint run_blocks = 0;  // Number of blocks in the pending run
+  uint run_offset = 0;  // Offset inside its first block
+  size_t run_size = 0;  // Number of bytes to write
+  sfs_entry_t tentry;
+  while(written < count) {
+    // Get chained entry for a given reference index number
+    const uint ntentry = get_nref_entry_from_pos(&tentry, &entry, disk,
+      nentry, block, pos);
+    if(ntentry >= ERROR_ANY) {
+      return ntentry;
+    }
+
+    // Add blocks referenced by this chained entry to runs
+    do {
+      const uint ref = tentry.ref[block % SFS_ENTRYREFS];
+
+      // Check for error (try to write in system blocks)
+      if(ref == 0 || ref == 1) {
+        debug_putstr("fs_write_file error: entryref=%u block=%u\n",
+          ref, block);
         return ERROR_IO;
       }
-      result = get_entry_n(&entry, disk, entry.next);
-      if(result >= ERROR_ANY) {
-        return result;
+
+      if(run_blocks == 0 || ref != run_ref + run_blocks) {
+        if(run_blocks != 0) {
+          result = write_disk(disk, run_ref, run_offset, run_size,
+            buff + written - run_size);
+          if(result != NO_ERROR) {
+            return result;
+          }
+        }
+        run_ref = ref;
+        run_blocks = 0;
+        run_offset = offset;
+        run_size = 0;
       }
-      offset -= SFS_ENTRYREFS*BLOCK_SIZE;
-      current_block -= SFS_ENTRYREFS;
-    }
 
-    // Check for error (try to write in system blocks)
-    if(entry.ref[current_block]==0 || entry.ref[current_block]==1) {
-      debug_putstr("fs_write_file error: entryref=%u current_block=%u\n",
-        entry.ref[current_block], current_block);
-      return ERROR_IO;
-    }
-    result = write_disk(disk, entry.ref[current_block],
-      offset%BLOCK_SIZE, to_copy, buff + written);
+      const size_t n = min(BLOCK_SIZE-offset, count-written);
+      run_blocks++;
+      run_size += n;
+      written += n;
+      block++;
+      offset = 0;
+    } while(written < count && block % SFS_ENTRYREFS != 0);
+  }
+
+  // Write the last run
+  if(run_blocks != 0) {
+    result = write_disk(disk, run_ref, run_offset, run_size,
+      buff + written - run_size);
     if(result != NO_ERROR) {
       return result;
     }
-    count -= to_copy;
-    offset += to_copy;
-    written += to_copy;
   }
 
   // Update file entry time
@@ -940,6 +1359,144 @@ uint fs_write_file(const void *buff, char *path, uint offset, size_t count, uint
   return written;
 }
 
+// Write buff to file given path, offset, count and flags
+uint fs_write_file(const void *buff, char *path, uint offset, size_t count, uint flags)
+{
+  debug_putstr("fs_write_file %x %s %u %u\n", buff, path, offset, count);
+
+  uint disk = 0;
+  const uint nentry = find_or_create_file(path, flags, &disk);
+  if(nentry >= ERROR_ANY) {
+    return nentry;
+  }
+
+  chain_pos_t pos = {0};
+  return write_file_n(buff, disk, nentry, offset, count, flags, &pos);
+}
+
+// Open a file
+uint fs_open(char *path, uint flags)
+{
+  debug_putstr("fs_open %s %x\n", path, flags);
+
+  // Find a free handle
+  uint h = 0;
+  while(h < FS_MAX_OPEN_FILES && open_file[h].used) {
+    h++;
+  }
+  if(h >= FS_MAX_OPEN_FILES) {
+    return ERROR_NO_SPACE;
+  }
+
+  uint disk = 0;
+  const uint nentry = find_or_create_file(path, flags, &disk);
+  if(nentry >= ERROR_ANY) {
+    return nentry;
+  }
+
+  const uint generation = (open_file[h].generation + 1) % FS_HANDLE_GENERATIONS;
+  memset(&open_file[h], 0, sizeof(open_file_t));
+  open_file[h].disk = disk;
+  open_file[h].nentry = nentry;
+  open_file[h].offset = 0;
+  open_file[h].flags = flags;
+  open_file[h].generation = generation;
+  open_file[h].used = TRUE;
+  return generation*FS_MAX_OPEN_FILES + h;
+}
+
+// Get open file given its handle, or 0 if not valid
+static open_file_t *get_open_file(uint handle)
+{
+  const uint h = handle % FS_MAX_OPEN_FILES;
+  if(handle >= FS_HANDLE_GENERATIONS*FS_MAX_OPEN_FILES ||
+    !open_file[h].used ||
+    open_file[h].generation != handle / FS_MAX_OPEN_FILES) {
+    return 0;
+  }
+  return &open_file[h];
+}
+
+// Check if a handle is valid and was opened with OF_USER flag
+bool fs_is_user_file(uint handle)
+{
+  open_file_t *f = get_open_file(handle);
+  return f != 0 && (f->flags & OF_USER);
+}
+
+// Read from an open file
+uint fs_read(uint handle, void *buff, size_t count)
+{
+  open_file_t *f = get_open_file(handle);
+  if(f == 0) {
+    return ERROR_NOT_FOUND;
+  }
+
+  sfs_entry_t entry;
+  uint result = get_entry_n(&entry, f->disk, f->nentry);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
+  if(!(entry.flags & T_FILE)) {
+    return ERROR_NOT_FOUND;
+  }
+
+  result = read_file_n(buff, f->disk, f->nentry, &entry, f->offset,
+    count, &f->pos);
+  if(result < ERROR_ANY) {
+    f->offset += result;
+  }
+  return result;
+}
+
+// Write to an open file
+uint fs_write(uint handle, const void *buff, size_t count)
+{
+  open_file_t *f = get_open_file(handle);
+  if(f == 0) {
+    return ERROR_NOT_FOUND;
+  }
+
+  const uint result = write_file_n(buff, f->disk, f->nentry, f->offset,
+    count, f->flags, &f->pos);
+  if(result < ERROR_ANY) {
+    f->offset += result;
+  }
+  return result;
+}
+
+// Set position of an open file
+uint fs_seek(uint handle, uint offset)
+{
+  open_file_t *f = get_open_file(handle);
+  if(f == 0) {
+    return ERROR_NOT_FOUND;
+  }
+  f->offset = offset;
+  return offset;
+}
+
+// Close an open file
+uint fs_close(uint handle)
+{
+  open_file_t *f = get_open_file(handle);
+  if(f == 0) {
+    return ERROR_NOT_FOUND;
+  }
+  f->used = FALSE;
+  return NO_ERROR;
+}
+
+// Close all files opened with OF_USER flag
+void fs_close_user_files()
+{
+  for(uint h=0; h<FS_MAX_OPEN_FILES; h++) {
+    if(open_file[h].flags & OF_USER) {
+      open_file[h].used = FALSE;
+    }
+  }
+}
+
 // Delete entry by index
 // Deletes the full chain
 static uint delete_n(uint disk, size_t n)
@@ -950,6 +1507,9 @@ static uint delete_n(uint disk, size_t n)
     return result;
   }
 
+  // Open files of this entry are no longer valid
+  close_entry_files(disk, n);
+
   // Delete reference in parent
   result = remove_ref_in_entry(disk, entry.parent, n);
   if(result >= ERROR_ANY) {
@@ -969,6 +1529,7 @@ static uint delete_n(uint disk, size_t n)
   }
 
   // Delete full chain
+  reset_chain_pos(disk);
   if(entry.next) {
     result = delete_n(disk, entry.next);
     if(result >= ERROR_ANY) {
@@ -976,6 +1537,12 @@ static uint delete_n(uint disk, size_t n)
     }
   }
 
+  // Free data blocks if it's a file
+  result = release_entry_refs(disk, &entry, 0);
+  if(result >= ERROR_ANY) {
+    return result;
+  }
+
   memset(&entry, 0, sizeof(entry));
   result = write_entry(&entry, disk, n);
   if(result >= ERROR_ANY) {
@@ -993,6 +1560,7 @@ uint fs_delete(char *path)
   sfs_entry_t entry;
   uint nentry = fs_get_entry(&entry, path, UNKNOWN_VALUE, UNKNOWN_VALUE);
   if(nentry < ERROR_ANY) {
+    dentry_invalidate(disk);
     nentry = delete_n(disk, nentry);
   }
 
@@ -1023,39 +1591,7 @@ uint fs_create_directory(char *path)
     return ERROR_EXISTS;
   }
 
-  // Find a free entry index
-  uint nentry = find_free_entry(disk);
-  if(nentry >= ERROR_ANY) {
-    return nentry;
-  }
-
-  // Create entry
-  memset(&entry, 0, sizeof(entry));
-  strncpy((char*)entry.name, path, SFS_NAMESIZE);
-  entry.size = 0;
-  entry.flags = T_DIR;
-  entry.parent = parent;
-  entry.next = 0;
-  result = write_entry(&entry, disk, nentry);
-  if(result >= ERROR_ANY) {
-    return result;
-  }
-
-  // Update modified time
-  result = set_entry_time_to_current(disk, nentry);
-  if(result >= ERROR_ANY) {
-    return result;
-  }
-
-  // Add reference in parent
-  if(nentry != entry.parent) {
-    result = add_ref_in_entry(disk, entry.parent, nentry);
-    if(result >= ERROR_ANY) {
-      return result;
-    }
-  }
-
-  return nentry;
+  return create_entry(&entry, disk, parent, path, T_DIR);
 }
 
 // Move entry
@@ -1088,6 +1624,8 @@ uint fs_move(char *srcpath, char *dstpath)
   if(nentry >= ERROR_ANY) {
     return nentry;
   }
+  dentry_invalidate(srcdisk);
+  dentry_invalidate(dstdisk);
 
   // If moving between disks, physically move data: copy and delete
   if(srcdisk != dstdisk) {
@@ -1158,15 +1696,26 @@ uint fs_copy(char *srcpath, char *dstpath)
 
   // If source is a file, just read and write the full file
   if(entry.flags & T_FILE) {
+    sfs_entry_t dst_entry;
+    const uint dst_nentry = create_entry(&dst_entry, dst_disk, dst_parent,
+      dstname, T_FILE);
+    if(dst_nentry >= ERROR_ANY) {
+      return dst_nentry;
+    }
+
+    chain_pos_t src_pos = {0};
+    chain_pos_t dst_pos = {0};
     uint offset = 0;
     uint copied = 0;
     char buff[BLOCK_SIZE] = {0};
 
-    while((copied = fs_read_file(buff, srcpath, offset, sizeof(buff)))) {
+    while((copied = read_file_n(buff, src_disk, nentry, &entry, offset,
+      sizeof(buff), &src_pos))) {
       if(copied >= ERROR_ANY) {
         return copied;
       }
-      result = fs_write_file(buff, dstpath, offset, copied, WF_CREATE);
+      result = write_file_n(buff, dst_disk, dst_nentry, offset, copied, 0,
+        &dst_pos);
       if(result >= ERROR_ANY) {
         return result;
       }
@@ -1326,15 +1875,43 @@ uint fs_format(uint disk)
   sb->nentries = min(
     (((sb->size * BLOCK_SIZE)/10)/sizeof(sfs_entry_t)),
     1024);
-  sb->bootstart = 2 + (sb->nentries * sizeof(sfs_entry_t)) / BLOCK_SIZE;
+  sb->bitmapstart = 2 + (sb->nentries * sizeof(sfs_entry_t)) / BLOCK_SIZE;
+  sb->bitmapblocks = (sb->size + SFS_BITMAPBITS - 1) / SFS_BITMAPBITS;
+  sb->bootstart = sb->bitmapstart + sb->bitmapblocks;
   result = write_disk(disk, 1, 0, BLOCK_SIZE, sb);
   if(result != 0) {
     return ERROR_IO;
   }
-  debug_putstr("format: disk=%2x blocks=%u entries=%u boot=%u\n",
-    disk, sb->size, sb->nentries, sb->bootstart);
+  debug_putstr("format: disk=%2x blocks=%u entries=%u bitmap=%u boot=%u\n",
+    disk, sb->size, sb->nentries, sb->bitmapstart, sb->bootstart);
+
+  // Files open in this disk are no longer valid
+  dentry_invalidate(disk);
+  for(uint h=0; h<FS_MAX_OPEN_FILES; h++) {
+    if(open_file[h].disk == disk) {
+      open_file[h].used = FALSE;
+    }
+  }
 
   const uint nentries = (uint)sb->nentries;
+  const uint bitmapstart = (uint)sb->bitmapstart;
+  const uint bitmapblocks = (uint)sb->bitmapblocks;
+  const uint first_data_block = (uint)sb->bootstart;
+
+  // Write allocation bitmap. Mark system blocks as used
+  for(uint b=0; b<bitmapblocks; b++) {
+    memset(buff, 0, sizeof(buff));
+    for(uint i=0; i<SFS_BITMAPBITS; i++) {
+      if(b*SFS_BITMAPBITS + i < first_data_block) {
+        buff[i / 8] |= (1 << (i % 8));
+      }
+    }
+    result = write_disk(disk, bitmapstart + b, 0, BLOCK_SIZE, buff);
+    if(result != 0) {
+      return ERROR_IO;
+    }
+  }
+  alloc_hint[disk] = first_data_block;
 
   // Create root dir
   memset(buff, 0, sizeof(buff));
@@ -15,19 +15,28 @@
 // With the current implementation, BLOCK_SIZE must be a power of 2
 
 // Disk layout:
-// [boot block | super block | entries table | data blocks]
+// [boot block | super block | entries table | allocation bitmap | data blocks]
 
 // Boot block    block 0           Boot sector
 // Super block   block 1           Contains information about the layout of the file system
 // Entries tab   blocks 2 to n     Table of file and directory entries
-// Data blocks   blocks n to end   Data blocks referenced by file entries
+// Bitmap        blocks n to m     Allocation bitmap (optional, see below)
+// Data blocks   blocks m to end   Data blocks referenced by file entries
 
 // Entries are referenced by their index on the entry table
 // Entry with index n is located at byte:
 //   2*BLOCK_SIZE + n*sizeof(sfs_entry_t)
 //
+// Allocation bitmap starts at block superblock.bitmapstart and
+// is superblock.bitmapblocks long. Bit (b % 8) of byte (b / 8) is set
+// when block b is in use. Blocks before the first data block (boot block,
+// super block, entries table and bitmap) are always marked as used.
+// Images created without bitmap have superblock.bitmapstart = 0. In this
+// case, free blocks are found by scanning the entries table.
+//
 // Data blocks start at block
 //   2 + ((superblock.nentries*sizeof(sfs_entry_t)) / BLOCK_SIZE)
+//     + superblock.bitmapblocks
 //
 // Data blocks are referenced by their absolute disk block index
 
@@ -39,8 +48,13 @@ typedef struct sfs_superblock_t { // On-disk superblock structure
   uint32_t  size;         // Total number of block in file system
   uint32_t  nentries;     // Number of entries in entries table
   uint32_t  bootstart;    // Block index of first boot program block
+  uint32_t  bitmapstart;  // Block index of first allocation bitmap block, or 0
+  uint32_t  bitmapblocks; // Number of allocation bitmap blocks
 } sfs_superblock_t;
 
+// Number of blocks whose allocation state fits in a bitmap block
+#define SFS_BITMAPBITS (BLOCK_SIZE*8)
+
 // The boot program must be stored in contiguous data blocks
 
 #define SFS_NAMESIZE    15  // Max length of entry name + final 0
@@ -168,6 +182,48 @@ uint fs_read_file(void *buff, char *path, uint offset, size_t count);
 // Returns number of written bytes or ERROR_NOT_FOUND
 uint fs_write_file(const void *buff, char *path, uint offset, size_t count, uint flags);
 
+// Open files
+// Handles allow sequential access to a file without resolving its path
+// and walking its chain of entries on each access
+#define FS_MAX_OPEN_FILES 8 // Max number of simultaneously open files
+
+// Open file flags (WF_* flags can also be used)
+#define OF_USER     0x8000 // Opened by a user program
+
+// Open file
+// Depending on flags, path file can be created (WF_CREATE), and it can be
+// truncated to the last written position on each write (WF_TRUNCATE).
+// Initial position is 0
+// Returns a file handle, ERROR_NO_SPACE if there are too many open files,
+// or ERROR_NOT_FOUND
+uint fs_open(char *path, uint flags);
+
+// Read open file
+// Output: buff
+// Reads count bytes starting at the current position, and advances it
+// Returns number of read bytes or ERROR_NOT_FOUND
+uint fs_read(uint handle, void *buff, size_t count);
+
+// Write open file
+// Writes count bytes starting at the current position, and advances it.
+// If file is not big enough, its size is increased.
+// Returns number of written bytes or ERROR_NOT_FOUND
+uint fs_write(uint handle, const void *buff, size_t count);
+
+// Set current position of an open file to offset
+// Returns offset or ERROR_NOT_FOUND
+uint fs_seek(uint handle, uint offset);
+
+// Close open file
+// Returns NO_ERROR or ERROR_NOT_FOUND
+uint fs_close(uint handle);
+
+// Close all files opened with OF_USER flag
+void fs_close_user_files();
+
+// Return TRUE if handle is valid and was opened with OF_USER flag
+bool fs_is_user_file(uint handle);
+
 // Move entry
 // In the case of directories, they are recursively moved
 // Returns:
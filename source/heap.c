@@ -0,0 +1,377 @@
+// Kernel heap
+
+#include "types.h"
+#include "kernel.h"
+#include "hwio.h"
+#include "ulib/ulib.h"
+#include "heap.h"
+
+// See heap.h for a description of the heap policy
+
+#define HEAP_LOW_PAGES   (HEAP_SIZE / HEAP_PAGE_SIZE)
+#define HEAP_MAX_ORDER  16 // Largest block is 2^16 pages (256MB)
+#define HEAP_NUM_CLASSES 8 // Slab sizes from HEAP_SLAB_MIN to HEAP_SLAB_MAX
+#define HEAP_NUM_ZONES   2 // Low memory and extended memory
+#define NO_PAGE          0xFFFFFFFF
+
+// Page states
+#define PAGE_TAIL 0 // Not the first page of a block
+#define PAGE_FREE 1 // First page of a free block
+#define PAGE_USED 2 // First page of an allocated block
+#define PAGE_SLAB 3 // Page used by a slab
+
+typedef struct page_t {
+  uint8_t   state;    // Page state
+  uint8_t   order;    // Block order (number of pages is 2^order)
+  uint8_t   class;    // Slab: size class
+  uint16_t  inuse;    // Slab: number of allocated objects
+  uint      next;     // Next page in free or slab list
+  uint      prev;     // Previous page in free or slab list
+  void     *free_obj; // Slab: first free object
+} page_t;
+
+// Zones are contiguous ranges of pages. Pages of all zones
+// are numbered consecutively
+typedef struct zone_t {
+  uint8_t *base;      // Address of the first page
+  uint     first;     // Number of the first page
+  uint     num_pages; // Number of pages
+} zone_t;
+
+static zone_t zone[HEAP_NUM_ZONES];
+static uint num_zones = 0;
+
+// Page descriptors. Stored in extended memory if there is any
+static page_t low_page[HEAP_LOW_PAGES];
+static page_t *page = low_page;
+
+static uint free_list[HEAP_MAX_ORDER+1]; // Free blocks of each order
+static uint slab_list[HEAP_NUM_CLASSES]; // Slabs with free objects
+static heap_stats_t stats = {0};
+
+// Get zone of a page
+static const zone_t *page_zone(uint p)
+{
+  uint z = 0;
+  while(z+1 < num_zones && p >= zone[z+1].first) {
+    z++;
+  }
+  return &zone[z];
+}
+
+// Get page address
+static uint8_t *page_addr(uint p)
+{
+  const zone_t *z = page_zone(p);
+  return z->base + (p - z->first)*HEAP_PAGE_SIZE;
+}
+
+// Get the page of an address
+// Returns NO_PAGE if address is not in the heap
+static uint addr_page(const void *ptr)
+{
+  for(uint z=0; z<num_zones; z++) {
+    if((uint8_t*)ptr >= zone[z].base &&
+      (uint8_t*)ptr < zone[z].base + zone[z].num_pages*HEAP_PAGE_SIZE) {
+      return zone[z].first + ((uint8_t*)ptr - zone[z].base)/HEAP_PAGE_SIZE;
+    }
+  }
+  return NO_PAGE;
+}
+
+// Get size in bytes of a slab class objects
+static uint class_size(uint c)
+{
+  return HEAP_SLAB_MIN << c;
+}
+
+// Add a page to the beginning of a list
+static void list_push(uint *list, uint p)
+{
+  page[p].prev = NO_PAGE;
+  page[p].next = *list;
+  if(*list != NO_PAGE) {
+    page[*list].prev = p;
+  }
+  *list = p;
+}
+
+// Remove a page from a list
+static void list_remove(uint *list, uint p)
+{
+  if(page[p].prev != NO_PAGE) {
+    page[page[p].prev].next = page[p].next;
+  } else {
+    *list = page[p].next;
+  }
+  if(page[p].next != NO_PAGE) {
+    page[page[p].next].prev = page[p].prev;
+  }
+}
+
+// Allocate a block of 2^order pages
+// Returns its first page or NO_PAGE
+static uint buddy_alloc(uint order)
+{
+  // Find the smallest free block big enough
+  uint o = order;
+  while(o <= HEAP_MAX_ORDER && free_list[o] == NO_PAGE) {
+    o++;
+  }
+  if(o > HEAP_MAX_ORDER) {
+    return NO_PAGE;
+  }
+
+  const uint p = free_list[o];
+  list_remove(&free_list[o], p);
+
+  // Split it, freeing the second halves
+  while(o > order) {
+    o--;
+    const uint b = p + (1<<o);
+    page[b].state = PAGE_FREE;
+    page[b].order = o;
+    list_push(&free_list[o], b);
+  }
+
+  page[p].state = PAGE_USED;
+  page[p].order = order;
+  return p;
+}
+
+// Free a block, merging it with its buddy while possible.
+// Buddies are found relative to the zone start
+static void buddy_free(uint p)
+{
+  const zone_t *z = page_zone(p);
+  uint o = page[p].order;
+
+  while(o < HEAP_MAX_ORDER) {
+    const uint b = z->first + ((p - z->first) ^ (1<<o));
+    if(b + (1<<o) > z->first + z->num_pages ||
+      page[b].state != PAGE_FREE || page[b].order != o) {
+      break;
+    }
+    list_remove(&free_list[o], b);
+    page[max(p, b)].state = PAGE_TAIL;
+    p = min(p, b);
+    o++;
+  }
+
+  page[p].state = PAGE_FREE;
+  page[p].order = o;
+  list_push(&free_list[o], p);
+}
+
+// Allocate an object from a slab
+static void *slab_alloc(uint c)
+{
+  // Create a new slab if there are no free objects
+  uint p = slab_list[c];
+  if(p == NO_PAGE) {
+    p = buddy_alloc(0);
+    if(p == NO_PAGE) {
+      return NULL;
+    }
+
+    page[p].state = PAGE_SLAB;
+    page[p].class = c;
+    page[p].inuse = 0;
+    page[p].free_obj = NULL;
+
+    // Link all objects in the free list
+    for(uint i=HEAP_PAGE_SIZE/class_size(c); i>0; i--) {
+      void **obj = (void**)(page_addr(p) + (i-1)*class_size(c));
+      *obj = page[p].free_obj;
+      page[p].free_obj = obj;
+    }
+
+    list_push(&slab_list[c], p);
+    stats.slab_pages++;
+  }
+
+  void **obj = page[p].free_obj;
+  page[p].free_obj = *obj;
+  page[p].inuse++;
+
+  // Slab is full
+  if(page[p].free_obj == NULL) {
+    list_remove(&slab_list[c], p);
+  }
+
+  return obj;
+}
+
+// Free an object of a slab
+static void slab_free(uint p, void *ptr)
+{
+  const uint c = page[p].class;
+
+  // Slab was full
+  if(page[p].free_obj == NULL) {
+    list_push(&slab_list[c], p);
+  }
+
+  *(void**)ptr = page[p].free_obj;
+  page[p].free_obj = ptr;
+  page[p].inuse--;
+
+  // Slab is empty: return page
+  if(page[p].inuse == 0) {
+    list_remove(&slab_list[c], p);
+    page[p].order = 0;
+    buddy_free(p);
+    stats.slab_pages--;
+  }
+}
+
+// Add a zone. All its pages are free
+static void add_zone(uint8_t *base, uint num_pages)
+{
+  zone_t *z = &zone[num_zones++];
+  const uint first = (num_zones > 1) ? zone[num_zones-2].first +
+    zone[num_zones-2].num_pages : 0;
+  z->base = base;
+  z->first = first;
+  z->num_pages = num_pages;
+
+  for(uint p=first; p<first+num_pages; p++) {
+    page[p].state = PAGE_TAIL;
+  }
+
+  // Add the biggest aligned blocks that fit
+  uint i = 0;
+  while(i < num_pages) {
+    uint o = 0;
+    while(o < HEAP_MAX_ORDER && (i & (1<<o)) == 0 &&
+      i + (2<<o) <= num_pages) {
+      o++;
+    }
+    page[first+i].state = PAGE_FREE;
+    page[first+i].order = o;
+    list_push(&free_list[o], first+i);
+    i += 1<<o;
+  }
+
+  stats.size += num_pages*HEAP_PAGE_SIZE;
+}
+
+// Init heap: all memory is free.
+// ext_size bytes of extended memory at MEM_EXT_BASE are added to the heap
+void heap_init(size_t ext_size)
+{
+  for(uint o=0; o<=HEAP_MAX_ORDER; o++) {
+    free_list[o] = NO_PAGE;
+  }
+  for(uint c=0; c<HEAP_NUM_CLASSES; c++) {
+    slab_list[c] = NO_PAGE;
+  }
+  memset(&stats, 0, sizeof(stats));
+  num_zones = 0;
+  page = low_page;
+
+  // Page descriptors of all zones are stored at
+  // the beginning of extended memory
+  const uint ext_pages = ext_size / HEAP_PAGE_SIZE;
+  const uint desc_size = (HEAP_LOW_PAGES + ext_pages)*sizeof(page_t);
+  const uint desc_pages = (desc_size + HEAP_PAGE_SIZE - 1)/HEAP_PAGE_SIZE;
+  const bool use_ext = (ext_pages > desc_pages);
+  if(use_ext) {
+    page = (page_t*)MEM_EXT_BASE;
+  }
+
+  add_zone((uint8_t*)HEAP_ADDRESS, HEAP_LOW_PAGES);
+  if(use_ext) {
+    add_zone((uint8_t*)MEM_EXT_BASE + desc_pages*HEAP_PAGE_SIZE,
+      ext_pages - desc_pages);
+  }
+
+  debug_putstr("Heap: %u KB in %u zones\n", stats.size/1024, num_zones);
+}
+
+// Allocate memory in heap
+void *heap_alloc(size_t size)
+{
+  if(size == 0) {
+    return NULL;
+  }
+
+  void *ptr = NULL;
+  uint allocated = 0;
+
+  if(size <= HEAP_SLAB_MAX) {
+    // Use the smallest class big enough
+    uint c = 0;
+    while(class_size(c) < size) {
+      c++;
+    }
+    ptr = slab_alloc(c);
+    allocated = class_size(c);
+
+  } else if(size <= ((uint)HEAP_PAGE_SIZE << HEAP_MAX_ORDER)) {
+    // Use the smallest block big enough
+    uint order = 0;
+    while(((uint)HEAP_PAGE_SIZE << order) < size) {
+      order++;
+    }
+    const uint p = buddy_alloc(order);
+    if(p != NO_PAGE) {
+      ptr = page_addr(p);
+    }
+    allocated = HEAP_PAGE_SIZE << order;
+  }
+
+  if(ptr == NULL) {
+    debug_putstr("Mem alloc: BAD ALLOC (%u bytes)\n", size);
+    stats.failed++;
+    return NULL;
+  }
+
+  stats.used += allocated;
+  stats.allocs++;
+  return ptr;
+}
+
+// Free memory in heap
+void heap_free(const void *ptr)
+{
+  if(ptr == NULL) {
+    return;
+  }
+
+  const uint p = addr_page(ptr);
+  const uint offset = (uint8_t*)ptr - (p == NO_PAGE ? NULL : page_addr(p));
+
+  if(p == NO_PAGE) {
+    debug_putstr("Mem free: bad pointer (%x)\n", ptr);
+
+  } else if(page[p].state == PAGE_SLAB &&
+    offset % class_size(page[p].class) == 0) {
+    stats.used -= class_size(page[p].class);
+    stats.allocs--;
+    slab_free(p, (void*)ptr);
+
+  } else if(page[p].state == PAGE_USED && offset == 0) {
+    stats.used -= HEAP_PAGE_SIZE << page[p].order;
+    stats.allocs--;
+    buddy_free(p);
+
+  } else {
+    debug_putstr("Mem free: bad pointer (%x)\n", ptr);
+  }
+}
+
+// Get heap statistics
+void heap_get_stats(heap_stats_t *s)
+{
+  stats.free = 0;
+  stats.largest = 0;
+  for(uint o=0; o<=HEAP_MAX_ORDER; o++) {
+    for(uint p=free_list[o]; p!=NO_PAGE; p=page[p].next) {
+      stats.free += (uint)HEAP_PAGE_SIZE << o;
+      stats.largest = (uint)HEAP_PAGE_SIZE << o;
+    }
+  }
+
+  memcpy(s, &stats, sizeof(stats));
+}
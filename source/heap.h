@@ -0,0 +1,46 @@
+// Kernel heap
+
+#ifndef _HEAP_H
+#define _HEAP_H
+
+// The heap is made of memory zones: a fixed low memory region, and
+// extended memory above 1MB if available. Zones are split by a buddy
+// allocator into blocks of 2^n pages. Blocks are split when a smaller
+// one is needed, and merged with their buddy when both are free.
+//
+// Requests of HEAP_SLAB_MAX bytes or less are served from slabs:
+// pages split into objects of a single size class (a power of two).
+// Pages are returned to the buddy allocator when all their objects
+// are free.
+
+#define HEAP_ADDRESS   0x30000 // Low memory zone linear address
+#define HEAP_SIZE      0x40000 // Low memory zone size in bytes
+#define HEAP_PAGE_SIZE  0x1000 // Smallest buddy block
+#define HEAP_SLAB_MIN       16 // Smallest slab object size
+#define HEAP_SLAB_MAX     2048 // Largest slab object size
+
+// Init heap: all memory is free.
+// ext_size bytes of extended memory at MEM_EXT_BASE are added to the heap
+void heap_init(size_t ext_size);
+
+// Allocate memory in heap
+// Returns NULL if there is not enough memory
+void *heap_alloc(size_t size);
+
+// Free memory in heap
+void heap_free(const void *ptr);
+
+// Heap statistics
+typedef struct heap_stats_t {
+  uint size;        // Heap size in bytes
+  uint used;        // Bytes in allocated blocks and objects
+  uint free;        // Bytes in free blocks
+  uint largest;     // Largest free block size in bytes
+  uint allocs;      // Current number of allocations
+  uint slab_pages;  // Pages used by slabs
+  uint failed;      // Failed allocations
+} heap_stats_t;
+
+void heap_get_stats(heap_stats_t *stats);
+
+#endif // _HEAP_H
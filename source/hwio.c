@@ -5,6 +5,9 @@
 #include "hwio.h"
 #include "ulib/ulib.h"
 #include "kernel.h"
+#include "pci.h"
+#include "net.h"
+#include "cache.h"
 
 
 // PC keyboard interface constants
@@ -212,59 +215,100 @@ void io_serial_putc(char c)
   }
 }
 
+// Put string (serial port)
+void io_serial_putstr(const char *str, size_t size)
+{
+  for(size_t i=0; i<size; i++) {
+    io_serial_putc(str[i]);
+  }
+}
+
 #define AT_DEFAULT (AT_T_LGRAY|AT_B_BLACK)
 static const uint VGA_PORT = 0x03D4;
 static const size_t VGA_WIDTH = 80;
 static const size_t VGA_HEIGHT = 28;
 static uint16_t *const VGA_MEMORY = (uint16_t*) 0xB8000;
+#define VGA_EMPTY_PAIR ((' '|(AT_DEFAULT<<8)) * 0x00010001)
 
-// Put char (screen)
-void io_vga_putc(char c, uint8_t attr)
-{
-  // Default attributes
-  if(attr == 0) {
-    attr = AT_DEFAULT;
-  }
+// Shadow of the hardware cursor position: col + width*row.
+// The CRTC is only read once, at first use
+#define VGA_CURSOR_UNKNOWN 0xFFFFFFFF
+static uint vga_cursor = VGA_CURSOR_UNKNOWN;
 
-  // Replace tabs with spaces
-  if(c == '\t') {
-    c = ' ';
+// Get cursor position
+static uint vga_get_cursor()
+{
+  if(vga_cursor == VGA_CURSOR_UNKNOWN) {
+    outb(VGA_PORT, 14);
+    vga_cursor = inb(VGA_PORT+1) << 8;
+    outb(VGA_PORT, 15);
+    vga_cursor |= inb(VGA_PORT+1);
   }
+  return vga_cursor;
+}
 
-  // Get cursor position: col + width*row
+// Set cursor position and program the CRTC
+static void vga_set_cursor(uint pos)
+{
+  vga_cursor = pos;
   outb(VGA_PORT, 14);
-  uint pos = inb(VGA_PORT+1) << 8;
+  outb(VGA_PORT+1, pos>>8);
   outb(VGA_PORT, 15);
-  pos |= inb(VGA_PORT+1);
+  outb(VGA_PORT+1, pos);
+}
 
-  // Set char
-  if(c == '\n') {
-    pos += VGA_WIDTH - pos%VGA_WIDTH;
-  } else if(c == '\r') {
-    pos -= pos%VGA_WIDTH;
-  } else {
-    VGA_MEMORY[pos++] = (c & 0xFF) | (attr << 8);
+// Scroll screen one line up, clearing the last line.
+// A line is an even number of chars, so it is moved as doubles
+static void vga_scroll()
+{
+  movsl(VGA_MEMORY, VGA_MEMORY+VGA_WIDTH,
+    (VGA_HEIGHT-1)*VGA_WIDTH/2);
+  stosl(VGA_MEMORY+(VGA_HEIGHT-1)*VGA_WIDTH, VGA_EMPTY_PAIR,
+    VGA_WIDTH/2);
+}
+
+// Put string (screen)
+// The CRTC cursor is only updated once the whole string is written
+void io_vga_putstr(const char *str, size_t size, uint8_t attr)
+{
+  // Default attributes
+  if(attr == 0) {
+    attr = AT_DEFAULT;
   }
 
-  // Scroll
-  if((pos/VGA_WIDTH) > (VGA_HEIGHT-1)) {
+  uint pos = vga_get_cursor();
 
-    memcpy(VGA_MEMORY, VGA_MEMORY+VGA_WIDTH,
-      sizeof(VGA_MEMORY[0])*(VGA_HEIGHT-1)*VGA_WIDTH);
+  for(size_t i=0; i<size; i++) {
+    char c = str[i];
 
-    pos -= VGA_WIDTH;
+    // Replace tabs with spaces
+    if(c == '\t') {
+      c = ' ';
+    }
 
-    const uint16_t empty = ' '|(AT_DEFAULT<<8);
-    for(uint i = pos; i<VGA_HEIGHT*VGA_WIDTH; i++) {
-      VGA_MEMORY[i] = empty;
+    // Set char
+    if(c == '\n') {
+      pos += VGA_WIDTH - pos%VGA_WIDTH;
+    } else if(c == '\r') {
+      pos -= pos%VGA_WIDTH;
+    } else {
+      VGA_MEMORY[pos++] = (c & 0xFF) | (attr << 8);
+    }
+
+    // Scroll
+    if((pos/VGA_WIDTH) > (VGA_HEIGHT-1)) {
+      vga_scroll();
+      pos -= VGA_WIDTH;
     }
   }
 
-  // Set cursor position
-  outb(VGA_PORT, 14);
-  outb(VGA_PORT+1, pos>>8);
-  outb(VGA_PORT, 15);
-  outb(VGA_PORT+1, pos);
+  vga_set_cursor(pos);
+}
+
+// Put char (screen)
+void io_vga_putc(char c, uint8_t attr)
+{
+  io_vga_putstr(&c, 1, attr);
 }
 
 // Write a char to screen in specific position
@@ -286,27 +330,39 @@ void io_vga_putc_attr(uint x, uint y, char c, uint8_t attr)
   return;
 }
 
-// Clear screen
-void io_vga_clear()
+// Copy a rectangle of cells (char | attr<<8) to screen.
+// Cells are stored by rows. The rectangle is clipped to the screen
+void io_vga_putrect(uint x, uint y, uint width, uint height,
+  const uint16_t *cells)
 {
-  const uint16_t empty = ' '|(AT_DEFAULT<<8);
-  for(uint x=0; x<VGA_WIDTH; x++) {
-    for(uint y=0; y<VGA_HEIGHT; y++) {
-      VGA_MEMORY[VGA_WIDTH*y+x] = empty;
+  if(x >= VGA_WIDTH || y >= VGA_HEIGHT) {
+    return;
+  }
+  const uint w = min(width, VGA_WIDTH-x);
+  const uint h = min(height, VGA_HEIGHT-y);
+
+  for(uint row=0; row<h; row++) {
+    uint16_t *dst = VGA_MEMORY + VGA_WIDTH*(y+row) + x;
+    const uint16_t *src = cells + width*row;
+    for(uint col=0; col<w; col++) {
+      // Default attributes
+      dst[col] = (src[col] & 0xFF00) ? src[col] :
+        (src[col] | (AT_DEFAULT<<8));
     }
   }
+}
 
+// Clear screen
+void io_vga_clear()
+{
+  stosl(VGA_MEMORY, VGA_EMPTY_PAIR, VGA_HEIGHT*VGA_WIDTH/2);
   io_vga_setcursorpos(0, 0);
 }
 
 // Get screen cursor position
 void io_vga_getcursorpos(uint *x, uint *y)
 {
-  outb(VGA_PORT, 14);
-  uint pos = inb(VGA_PORT+1) << 8;
-  outb(VGA_PORT, 15);
-  pos |= inb(VGA_PORT+1);
-
+  const uint pos = vga_get_cursor();
   *x = pos % VGA_WIDTH;
   *y = pos / VGA_WIDTH;
 }
@@ -314,11 +370,7 @@ void io_vga_getcursorpos(uint *x, uint *y)
 // Set screen cursor position
 void io_vga_setcursorpos(uint x, uint y)
 {
-  const uint pos = VGA_WIDTH*y + x;
-  outb(VGA_PORT, 14);
-  outb(VGA_PORT+1, pos>>8);
-  outb(VGA_PORT, 15);
-  outb(VGA_PORT+1, pos);
+  vga_set_cursor(VGA_WIDTH*y + x);
 }
 
 // Show or hide screen cursor
@@ -405,6 +457,10 @@ static uint get_currentsecond()
 }
 
 
+// Interrupt locks. See enable_interrupts and disable_interrupts
+#define INT_NO_LOCK 1
+static volatile uint interrupt_locks = INT_NO_LOCK;
+
 // IRQs
 #define T_IRQ0          32   // IRQ 0 corresponds to int T_IRQ
 
@@ -484,6 +540,8 @@ extern void *idtr;
 extern uint32_t pidt;
 void IRQNet_wrapper();
 void IRQSound_wrapper();
+void IRQDisk_wrapper();
+void IRQFloppy_wrapper();
 
 // Set network IRQ handler
 void set_network_IRQ(uint irq)
@@ -501,6 +559,22 @@ void set_network_IRQ(uint irq)
   ioapic_enable(irq);
 }
 
+// Set disk IRQ handler
+static void set_disk_IRQ(uint irq, void (*wrapper)())
+{
+  struct IDT_entry volatile *pIDT = (struct IDT_entry*)pidt;
+
+  pIDT[T_IRQ0+irq].offset_lowerbits = (uint32_t)wrapper & 0xFFFF;
+  pIDT[T_IRQ0+irq].selector = 0x08; // KERNEL_CODE_SEGMENT_OFFSET
+  pIDT[T_IRQ0+irq].zero = 0;
+  pIDT[T_IRQ0+irq].type_attr = 0x8F; // INTERRUPT_GATE
+  pIDT[T_IRQ0+irq].offset_higherbits = ((uint32_t)wrapper & 0xFFFF0000) >> 16;
+
+  __asm__("lidt (%0)" : : "m" (idtr));
+
+  ioapic_enable(irq);
+}
+
 // Set sound IRQ handler
 void set_sound_IRQ(uint irq)
 {
@@ -629,6 +703,7 @@ void spurious_handler()
 }
 
 // Timer handler
+static void FDC_timer();
 void timer_handler()
 {
   clock_ints++;
@@ -656,8 +731,17 @@ void timer_handler()
     }
   }
 
+  // Turn off idle floppy motor
+  FDC_timer();
+
+  // Resolve pending network addresses
+  io_net_timer();
+
   // Acknowledge
   lapic_eoi();
+
+  // Write delayed disk writes. Disk IRQs can be received now
+  cache_timer();
 }
 
 // Get system miliseconds
@@ -802,6 +886,74 @@ static uint ATA_PIO_waitdisk()
   return NO_ERROR;
 }
 
+// Wait until an IRQ handler sets a flag, or timeout miliseconds pass.
+// If flag is NULL, just wait. Interrupts are enabled while waiting,
+// even if the caller disabled them, so other devices can be serviced.
+// The CPU is halted meanwhile
+// Return TRUE if the flag was set
+static bool wait_IRQ(volatile bool *flag, uint timeout)
+{
+  const uint locks = interrupt_locks;
+  interrupt_locks = INT_NO_LOCK;
+
+  const uint start = io_gettimer();
+  x86_cli();
+  while(flag == NULL || !*flag) {
+    if(io_gettimer() - start > timeout) {
+      break;
+    }
+    // Atomically enable interrupts and wait for the next one
+    x86_sti_hlt();
+    x86_cli();
+  }
+
+  interrupt_locks = locks;
+  return flag != NULL && *flag;
+}
+
+// ATA interrupts
+// When enabled, the disk raises IRQ14 (primary channel) or IRQ15
+// (secondary channel) when a command completes or data is ready.
+// Other IRQs can run while waiting for them
+#define ATA_IRQ_PRIMARY    14
+#define ATA_IRQ_SECONDARY  15
+#define ATA_IRQ_TIMEOUT  2000 // Miliseconds
+
+static bool ATA_IRQ_enabled = FALSE;
+static volatile bool ATA_IRQ_received = FALSE;
+
+// Disk IRQ handler
+void disk_handler()
+{
+  disable_interrupts();
+
+  // Reading status acknowledges the interrupt in the disk
+  inb(0x1F7);
+  inb(0x177);
+  ATA_IRQ_received = TRUE;
+
+  lapic_eoi();
+  enable_interrupts();
+}
+
+// Must be called before issuing a command or transferring data
+// that will raise an interrupt
+static void ATA_IRQ_prepare()
+{
+  ATA_IRQ_received = FALSE;
+}
+
+// Wait for a disk interrupt, if enabled, and then for disk ready.
+// Return NO_ERROR on success
+static uint ATA_wait()
+{
+  if(ATA_IRQ_enabled && !wait_IRQ(&ATA_IRQ_received, ATA_IRQ_TIMEOUT)) {
+    debug_putstr("ATA wait IRQ: timeout\n");
+  }
+
+  return ATA_PIO_waitdisk();
+}
+
 // Read sectors using ATA PIO mode
 // Return NO_ERROR on success
 static uint ATA_PIO_readsector(uint disk, uint sector, size_t n, void *buff)
@@ -812,25 +964,29 @@ static uint ATA_PIO_readsector(uint disk, uint sector, size_t n, void *buff)
   outb(0x1F3, sector & 0xFF);
   outb(0x1F4, (sector>>8) & 0xFF);
   outb(0x1F5, (sector>>16) & 0xFF);
+  ATA_IRQ_prepare();
   outb(0x1F7, IDE_CMD_READ);
 
-  uint result = ATA_PIO_waitdisk();
-  if(result != NO_ERROR) {
-    debug_putstr("ATA read disk wait(0) failed. disk=%2x\n", disk);
-    return result;
-  }
+  // Disk raises an interrupt when each sector is ready
+  uint result = NO_ERROR;
+  for(uint s=0; s<n; s++) {
+    result = ATA_wait();
+    if(result != NO_ERROR) {
+      debug_putstr("ATA read disk wait failed. disk=%2x\n", disk);
+      return result;
+    }
 
-  // Read and copy data
-  insl(0x1F0, buff, n*DISK_SECTOR_SIZE/4);
-  result = ATA_PIO_waitdisk();
-  if(result != NO_ERROR) {
-    debug_putstr("ATA read disk wait(1) failed. disk=%2x\n", disk);
-    return result;
+    // Read and copy data
+    ATA_IRQ_prepare();
+    insl(0x1F0, buff + s*DISK_SECTOR_SIZE, DISK_SECTOR_SIZE/4);
   }
 
   return result;
 }
 
+// Disks with written data which could still be in their write cache
+static bool ATA_flush_pending[MAX_DISK] = {FALSE};
+
 // Write sectors using ATA PIO mode
 // Return NO_ERROR on success
 static uint ATA_PIO_writesector(uint disk, uint sector, size_t n, const void *buff)
@@ -843,30 +999,198 @@ static uint ATA_PIO_writesector(uint disk, uint sector, size_t n, const void *bu
   outb(0x1F5, (sector>>16) & 0xFF);
   outb(0x1F7, IDE_CMD_WRITE);
 
+  // The first sector is requested without an interrupt.
+  // Then disk raises an interrupt when each sector is written
   uint result = ATA_PIO_waitdisk();
+  for(uint s=0; s<n && result==NO_ERROR; s++) {
+    ATA_IRQ_prepare();
+    outsl(0x1F0, buff + s*DISK_SECTOR_SIZE, DISK_SECTOR_SIZE/4);
+    result = ATA_wait();
+  }
   if(result != NO_ERROR) {
-    debug_putstr("ATA write disk wait(0) failed. disk=%2x\n", disk);
+    debug_putstr("ATA write disk wait failed. disk=%2x\n", disk);
     return result;
   }
 
-  outsl(0x1F0, buff, n*DISK_SECTOR_SIZE/4);
-  result = ATA_PIO_waitdisk();
+  return result;
+}
+
+// Flush ATA disk write cache
+// Return NO_ERROR on success
+static uint ATA_flush(uint disk)
+{
+  outb(0x1F6, (((disk-2)&1)<<4) | 0xE0);
+  ATA_IRQ_prepare();
+  outb(0x1F7, IDE_CMD_FLUSH);
+
+  const uint result = ATA_wait();
   if(result != NO_ERROR) {
-    debug_putstr("ATA write disk wait(1) failed. disk=%2x\n", disk);
-    return result;
+    debug_putstr("ATA flush disk wait failed. disk=%2x\n", disk);
   }
 
-  // Manual flush
-  outb(0x1F7, IDE_CMD_FLUSH);
-  result = ATA_PIO_waitdisk();
+  return result;
+}
+
+// ATA bus master DMA
+// PIIX IDE controllers can move data between disks and memory without
+// CPU intervention. Memory regions are described by a PRD
+// (Physical Region Descriptor) table. Only the primary channel is used
+#define ATA_DMA_CMD    0x00 // Bus master command register (base offset)
+#define ATA_DMA_STATUS 0x02 // Bus master status register
+#define ATA_DMA_PRDT   0x04 // PRD table address register
+
+#define ATA_DMA_CMD_START 0x01 // Start transfer
+#define ATA_DMA_CMD_READ  0x08 // Transfer from disk to memory
+
+#define ATA_DMA_STATUS_ACTIVE 0x01 // Transfer in progress
+#define ATA_DMA_STATUS_ERR    0x02 // Transfer failed
+#define ATA_DMA_STATUS_IRQ    0x04 // Disk raised an interrupt
+
+#define IDE_CMD_READ_DMA  0xC8
+#define IDE_CMD_WRITE_DMA 0xCA
+
+typedef struct ATA_PRD_t {
+  uint32_t address; // Physical address of the memory region
+  uint16_t size;    // Size in bytes, 0 means 64KB
+  uint16_t flags;   // ATA_PRD_LAST in the last descriptor
+} ATA_PRD_t;
+
+#define ATA_PRD_LAST 0x8000
+#define ATA_PRD_MAX  8 // Enough for 255 sectors in any buffer
+
+// PRD table can not cross a 64KB boundary
+#define ATA_PRDT_ADDRESS 0x76800 // Linear memory address
+static ATA_PRD_t *ATA_PRDT = (ATA_PRD_t*)ATA_PRDT_ADDRESS;
+
+// Bus master IO ports base, or 0 if DMA is not available
+static uint ATA_DMA_base = 0;
+
+#define NUM_ATA_DMA_COMPATIBLE_DEVICES 3
+static struct ATA_device_id_t {
+  uint16_t  vendor_id;
+  uint16_t  device_id;
+} const ATA_DMA_compatible[NUM_ATA_DMA_COMPATIBLE_DEVICES] = {
+  {0x8086, 0x1230}, // PIIX
+  {0x8086, 0x7010}, // PIIX3
+  {0x8086, 0x7111}  // PIIX4
+};
+
+// Find a bus master IDE controller and enable it
+static void ATA_DMA_init()
+{
+  ATA_DMA_base = 0;
+
+  PCI_device_t *pdev = NULL;
+  for(uint i=0; i<NUM_ATA_DMA_COMPATIBLE_DEVICES && pdev==NULL; i++) {
+    pdev = pci_find_device(ATA_DMA_compatible[i].vendor_id,
+      ATA_DMA_compatible[i].device_id);
+  }
+
+  // BAR4 contains the bus master IO ports base
+  if(pdev && (pdev->bar4 & 1)) {
+    pci_enable_bus_master(pdev);
+    ATA_DMA_base = pdev->bar4 & ~3;
+    outb(ATA_DMA_base + ATA_DMA_CMD, 0);
+    debug_putstr("ATA DMA: bus master IDE found. base=%x\n", ATA_DMA_base);
+  }
+}
+
+// Start a transfer of n sectors (max 255) using ATA bus master DMA
+// buff must be word aligned
+// ATA_DMA_finish must be called to complete the transfer
+// Return NO_ERROR on success
+static uint ATA_DMA_start(uint disk, uint sector, size_t n, const void *buff,
+  bool write)
+{
+  // Fill PRD table. Regions can not cross a 64KB boundary
+  uint address = (uint)buff;
+  uint remaining = n*DISK_SECTOR_SIZE;
+  uint p = 0;
+  while(remaining > 0) {
+    if(p >= ATA_PRD_MAX) {
+      return ERROR_IO;
+    }
+    const uint size = min(remaining, 0x10000 - (address & 0xFFFF));
+    ATA_PRDT[p].address = address;
+    ATA_PRDT[p].size = size & 0xFFFF;
+    ATA_PRDT[p].flags = 0;
+    address += size;
+    remaining -= size;
+    p++;
+  }
+  ATA_PRDT[p-1].flags = ATA_PRD_LAST;
+
+  // Setup bus master, and clear error and interrupt status
+  const uint8_t direction = write ? 0 : ATA_DMA_CMD_READ;
+  outb(ATA_DMA_base + ATA_DMA_CMD, 0);
+  outd(ATA_DMA_base + ATA_DMA_PRDT, ATA_PRDT_ADDRESS);
+  outb(ATA_DMA_base + ATA_DMA_CMD, direction);
+  outb(ATA_DMA_base + ATA_DMA_STATUS, inb(ATA_DMA_base + ATA_DMA_STATUS) |
+    ATA_DMA_STATUS_ERR | ATA_DMA_STATUS_IRQ);
+
+  // Issue command
+  outb(0x1F6, ((sector>>24)&0x0F) | (((disk-2)&1)<<4) | 0xE0);
+  outb(0x1F2, n);
+  outb(0x1F3, sector & 0xFF);
+  outb(0x1F4, (sector>>8) & 0xFF);
+  outb(0x1F5, (sector>>16) & 0xFF);
+  ATA_IRQ_prepare();
+  outb(0x1F7, write ? IDE_CMD_WRITE_DMA : IDE_CMD_READ_DMA);
+
+  // Start transfer
+  outb(ATA_DMA_base + ATA_DMA_CMD, direction | ATA_DMA_CMD_START);
+  return NO_ERROR;
+}
+
+// Wait until the current ATA bus master DMA transfer finishes
+// Return NO_ERROR on success
+static uint ATA_DMA_finish()
+{
+  // Disk raises an interrupt when the transfer finishes
+  uint result = ATA_wait();
+
+  uint8_t status = 0;
+  for(uint i=0; i<ATA_ATTEMPTS; i++) {
+    status = inb(ATA_DMA_base + ATA_DMA_STATUS);
+    if(!(status & ATA_DMA_STATUS_ACTIVE) || (status & ATA_DMA_STATUS_ERR)) {
+      break;
+    }
+  }
+
+  // Stop bus master, and clear its interrupt status
+  outb(ATA_DMA_base + ATA_DMA_CMD, 0);
+  outb(ATA_DMA_base + ATA_DMA_STATUS, status | ATA_DMA_STATUS_IRQ);
+
+  if(result == NO_ERROR &&
+    (status & (ATA_DMA_STATUS_ACTIVE | ATA_DMA_STATUS_ERR))) {
+    result = ERROR_IO;
+  }
   if(result != NO_ERROR) {
-    debug_putstr("ATA write disk wait(2) failed. disk=%2x\n", disk);
-    return result;
+    debug_putstr("ATA DMA transfer failed (%2x)\n", status);
+  }
+
+  return result;
+}
+
+// Read or write sectors using ATA bus master DMA
+// Return NO_ERROR on success
+static uint ATA_DMA_transfer(uint disk, uint sector, size_t n,
+  const void *buff, bool write)
+{
+  uint result = ATA_DMA_start(disk, sector, n, buff, write);
+  if(result == NO_ERROR) {
+    result = ATA_DMA_finish();
   }
 
   return result;
 }
 
+// Check if a buffer can be used for ATA bus master DMA
+static bool ATA_DMA_usable(const void *buff)
+{
+  return ATA_DMA_base != 0 && ((uint)buff & 1) == 0;
+}
+
 // Detect ATA disk size and modelm return number of sectors if found
 // Return 0 if not found
 static size_t ATA_detect(uint disk, char *model, size_t model_size )
@@ -951,6 +1275,454 @@ static size_t ATA_detect(uint disk, char *model, size_t model_size )
   return num_sectors;
 }
 
+typedef struct chs_t {
+  uint cylinder;
+  uint head;
+  uint sector;
+} chs_t;
+
+static void lba_to_chs( uint lba, uint spt, uint nh, chs_t *chs)
+{
+  const uint temp = lba / spt;
+  chs->sector = 1 + (lba % spt);
+  chs->head = temp % nh;
+  chs->cylinder = temp / nh;
+}
+
+// Floppy disk controller (82077AA compatible)
+// Floppy disks are accessed through the controller using ISA DMA
+// channel 2. Entire cylinders (both heads) are read at once and kept
+// in a track buffer, so sequential sector reads need a single transfer
+#define FDC_DOR   0x3F2 // Digital output register
+#define FDC_MSR   0x3F4 // Main status register
+#define FDC_FIFO  0x3F5 // Data FIFO
+#define FDC_CCR   0x3F7 // Configuration control register (write)
+#define FDC_DIR   0x3F7 // Digital input register (read)
+
+#define FDC_DOR_NORESET 0x04 // Clear to reset the controller
+#define FDC_DOR_IRQ     0x08 // Enable IRQ and DMA
+#define FDC_DOR_MOTOR   0x10 // Drive 0 motor. Shift left for other drives
+
+#define FDC_MSR_RQM 0x80 // FIFO ready
+#define FDC_MSR_DIO 0x40 // FIFO direction is controller to CPU
+
+#define FDC_DIR_CHANGED 0x80 // Disk was changed
+
+#define FDC_CMD_SPECIFY     0x03
+#define FDC_CMD_WRITE       0xC5 // Multitrack, MFM
+#define FDC_CMD_READ        0xE6 // Multitrack, MFM, skip deleted
+#define FDC_CMD_RECALIBRATE 0x07
+#define FDC_CMD_SENSE_INT   0x08
+#define FDC_CMD_SEEK        0x0F
+
+#define FDC_IRQ          6
+#define FDC_IRQ_TIMEOUT  2000 // Miliseconds
+#define FDC_MOTOR_IDLE   3000 // Miliseconds before turning motor off
+#define FDC_MOTOR_DELAY   500 // Miliseconds to spin up the motor
+#define FDC_ATTEMPTS        3 // Transfer attempts before failing
+#define FDC_NO_DRIVE     0xFF
+
+// ISA DMA controller ports for channel 2
+#define DMA2_ADDR     0x04
+#define DMA2_COUNT    0x05
+#define DMA2_PAGE     0x81
+#define DMA1_MASK     0x0A
+#define DMA1_MODE     0x0B
+#define DMA1_FLIPFLOP 0x0C
+
+#define DMA2_MODE_READ  0x46 // Single, device to memory, channel 2
+#define DMA2_MODE_WRITE 0x4A // Single, memory to device, channel 2
+
+// Cylinder buffer, for up to 2 heads of 18 sectors (1.44MB disks).
+// 2.88MB disks have 36 sectors per track: their cylinders don't fit,
+// so they are transferred in parts, not buffered.
+// ISA DMA transfers can not cross a 64KB boundary
+#define FDC_TRACK_ADDRESS 0x72000 // Linear memory address
+#define FDC_TRACK_SIZE    0x4800  // Bytes, ends at ATA_PRDT_ADDRESS
+#define FDC_MAX_SECTORS   36      // Sectors per track
+static uint8_t *FDC_track = (uint8_t*)FDC_TRACK_ADDRESS;
+
+static bool FDC_enabled = FALSE;
+static volatile bool FDC_IRQ_received = FALSE;
+static volatile bool FDC_busy = FALSE;
+static volatile uint FDC_motor = FDC_NO_DRIVE; // Drive with motor on
+static uint FDC_last_use = 0;       // io_gettimer value
+static bool FDC_calibrated[2] = {FALSE};
+static bool FDC_changed[2] = {FALSE}; // Not yet reported media change
+static bool FDC_change_seen[2] = {FALSE}; // Change line seen since last seek
+
+// Cylinder currently in the track buffer
+static struct FDC_track_state_t {
+  bool valid;
+  uint disk;
+  uint cylinder;
+} FDC_track_state = {0};
+
+// Floppy IRQ handler
+void floppy_handler()
+{
+  disable_interrupts();
+  FDC_IRQ_received = TRUE;
+  lapic_eoi();
+  enable_interrupts();
+}
+
+// Called from the timer handler. Turns motor off when idle
+static void FDC_timer()
+{
+  if(FDC_enabled && !FDC_busy && FDC_motor != FDC_NO_DRIVE &&
+    io_gettimer() - FDC_last_use > FDC_MOTOR_IDLE) {
+    outb(FDC_DOR, FDC_DOR_NORESET | FDC_DOR_IRQ);
+    FDC_motor = FDC_NO_DRIVE;
+    // Media changes can't be detected while the motor is off
+    FDC_track_state.valid = FALSE;
+  }
+}
+
+// Check the disk change line. It's only valid with the motor on,
+// and it's not cleared until the next seek
+static void FDC_check_changed(uint drive)
+{
+  if(FDC_motor == drive && !FDC_change_seen[drive] &&
+    (inb(FDC_DIR) & FDC_DIR_CHANGED)) {
+    FDC_changed[drive] = TRUE;
+    FDC_change_seen[drive] = TRUE;
+    if(FDC_track_state.disk == drive) {
+      FDC_track_state.valid = FALSE;
+    }
+  }
+}
+
+// Send a byte to the controller
+// Return NO_ERROR on success
+static uint FDC_write(uint8_t data)
+{
+  for(uint i=0; i<ATA_ATTEMPTS; i++) {
+    if((inb(FDC_MSR) & (FDC_MSR_RQM | FDC_MSR_DIO)) == FDC_MSR_RQM) {
+      outb(FDC_FIFO, data);
+      return NO_ERROR;
+    }
+  }
+  debug_putstr("FDC write: timeout\n");
+  return ERROR_IO;
+}
+
+// Receive a byte from the controller
+// Return NO_ERROR on success
+static uint FDC_read(uint8_t *data)
+{
+  for(uint i=0; i<ATA_ATTEMPTS; i++) {
+    if((inb(FDC_MSR) & (FDC_MSR_RQM | FDC_MSR_DIO)) ==
+      (FDC_MSR_RQM | FDC_MSR_DIO)) {
+      *data = inb(FDC_FIFO);
+      return NO_ERROR;
+    }
+  }
+  debug_putstr("FDC read: timeout\n");
+  return ERROR_IO;
+}
+
+// Wait for the controller interrupt and get its status
+// Return NO_ERROR on success
+static uint FDC_sense_interrupt(uint8_t *st0, uint8_t *cylinder)
+{
+  if(!wait_IRQ(&FDC_IRQ_received, FDC_IRQ_TIMEOUT)) {
+    debug_putstr("FDC wait IRQ: timeout\n");
+    return ERROR_IO;
+  }
+
+  uint result = FDC_write(FDC_CMD_SENSE_INT);
+  if(result == NO_ERROR) {
+    result = FDC_read(st0);
+  }
+  if(result == NO_ERROR) {
+    result = FDC_read(cylinder);
+  }
+  return result;
+}
+
+// Reset controller
+// Return NO_ERROR on success
+static uint FDC_reset()
+{
+  FDC_IRQ_received = FALSE;
+  outb(FDC_DOR, 0);
+  outb(FDC_DOR, FDC_DOR_NORESET | FDC_DOR_IRQ);
+  FDC_motor = FDC_NO_DRIVE;
+  FDC_calibrated[0] = FDC_calibrated[1] = FALSE;
+  FDC_track_state.valid = FALSE;
+
+  // Controller reports a reset for each drive
+  uint8_t st0 = 0;
+  uint8_t cylinder = 0;
+  uint result = FDC_sense_interrupt(&st0, &cylinder);
+  for(uint i=1; i<4 && result==NO_ERROR; i++) {
+    result = FDC_write(FDC_CMD_SENSE_INT);
+    result += FDC_read(&st0);
+    result += FDC_read(&cylinder);
+  }
+
+  // Step rate 3ms, head unload 240ms, head load 4ms, use DMA
+  if(result == NO_ERROR) {
+    result = FDC_write(FDC_CMD_SPECIFY);
+    result += FDC_write(0xDF);
+    result += FDC_write(0x02);
+  }
+
+  if(result != NO_ERROR) {
+    debug_putstr("FDC reset failed\n");
+    return ERROR_IO;
+  }
+  return NO_ERROR;
+}
+
+// Turn on drive motor and select drive
+static void FDC_motor_on(uint drive)
+{
+  outb(FDC_DOR, (FDC_DOR_MOTOR<<drive) | FDC_DOR_NORESET | FDC_DOR_IRQ | drive);
+  if(FDC_motor != drive) {
+    FDC_motor = drive;
+    wait_IRQ(NULL, FDC_MOTOR_DELAY);
+  }
+}
+
+// Move drive head to cylinder
+// Return NO_ERROR on success
+static uint FDC_seek(uint drive, uint cylinder, uint head)
+{
+  uint8_t st0 = 0;
+  uint8_t pcn = 0;
+  uint result = NO_ERROR;
+
+  if(!FDC_calibrated[drive]) {
+    FDC_IRQ_received = FALSE;
+    result = FDC_write(FDC_CMD_RECALIBRATE);
+    result += FDC_write(drive);
+    if(result == NO_ERROR) {
+      result = FDC_sense_interrupt(&st0, &pcn);
+    }
+    if(result != NO_ERROR || (st0 & 0xC0) || pcn != 0) {
+      debug_putstr("FDC recalibrate failed (%2x)\n", st0);
+      return ERROR_IO;
+    }
+    FDC_calibrated[drive] = TRUE;
+  }
+
+  FDC_IRQ_received = FALSE;
+  result = FDC_write(FDC_CMD_SEEK);
+  result += FDC_write((head<<2) | drive);
+  result += FDC_write(cylinder);
+  if(result == NO_ERROR) {
+    result = FDC_sense_interrupt(&st0, &pcn);
+  }
+  if(result != NO_ERROR || (st0 & 0xC0) || pcn != cylinder) {
+    debug_putstr("FDC seek failed (%2x)\n", st0);
+    FDC_calibrated[drive] = FALSE;
+    return ERROR_IO;
+  }
+
+  FDC_change_seen[drive] = FALSE;
+  return NO_ERROR;
+}
+
+// Program ISA DMA channel 2
+static void FDC_DMA_setup(const void *buff, size_t size, bool write)
+{
+  const uint address = (uint)buff;
+  outb(DMA1_MASK, 0x06); // Mask channel 2
+  outb(DMA1_FLIPFLOP, 0xFF);
+  outb(DMA2_ADDR, address & 0xFF);
+  outb(DMA2_ADDR, (address >> 8) & 0xFF);
+  outb(DMA2_PAGE, (address >> 16) & 0xFF);
+  outb(DMA1_FLIPFLOP, 0xFF);
+  outb(DMA2_COUNT, (size - 1) & 0xFF);
+  outb(DMA2_COUNT, ((size - 1) >> 8) & 0xFF);
+  outb(DMA1_MODE, write ? DMA2_MODE_WRITE : DMA2_MODE_READ);
+  outb(DMA1_MASK, 0x02); // Unmask channel 2
+}
+
+// Read or write n sectors of a cylinder, starting at head and sector.
+// Buffer must be in the track buffer
+// Return NO_ERROR on success
+static uint FDC_transfer(uint disk, const chs_t *chs, size_t n,
+  const void *buff, bool write)
+{
+  const uint drive = disk;
+  uint result = ERROR_IO;
+
+  FDC_busy = TRUE;
+  for(uint attempt=0; attempt<FDC_ATTEMPTS && result!=NO_ERROR; attempt++) {
+    if(attempt > 0 && FDC_reset() != NO_ERROR) {
+      break;
+    }
+
+    FDC_motor_on(drive);
+    FDC_check_changed(drive);
+    // 1 Mbps for 2.88MB disks, 500 kbps for 1.44MB and 1.2MB disks,
+    // 250 kbps for 720KB disks
+    const uint spt = disk_info[disk].sectors;
+    outb(FDC_CCR, spt > 18 ? 3 : spt == 9 ? 2 : 0);
+
+    if(FDC_seek(drive, chs->cylinder, chs->head) != NO_ERROR) {
+      continue;
+    }
+
+    FDC_DMA_setup(buff, n * DISK_SECTOR_SIZE, write);
+
+    FDC_IRQ_received = FALSE;
+    result = FDC_write(write ? FDC_CMD_WRITE : FDC_CMD_READ);
+    result += FDC_write((chs->head<<2) | drive);
+    result += FDC_write(chs->cylinder);
+    result += FDC_write(chs->head);
+    result += FDC_write(chs->sector);
+    result += FDC_write(2); // 512 bytes per sector
+    result += FDC_write(disk_info[disk].sectors); // Last sector in track
+    result += FDC_write(0x1B); // Gap length
+    result += FDC_write(0xFF); // Unused data length
+    if(result != NO_ERROR) {
+      continue;
+    }
+
+    if(!wait_IRQ(&FDC_IRQ_received, FDC_IRQ_TIMEOUT)) {
+      debug_putstr("FDC wait IRQ: timeout\n");
+      result = ERROR_IO;
+      continue;
+    }
+
+    // Result phase: ST0, ST1, ST2, cylinder, head, sector, size
+    uint8_t status[7] = {0};
+    for(uint i=0; i<sizeof(status) && result==NO_ERROR; i++) {
+      result = FDC_read(&status[i]);
+    }
+    if(result == NO_ERROR && (status[0] & 0xC0)) {
+      debug_putstr("FDC %s failed (%2x %2x %2x)\n",
+        write ? "write" : "read", status[0], status[1], status[2]);
+      result = ERROR_IO;
+    }
+  }
+
+  FDC_last_use = io_gettimer();
+  FDC_busy = FALSE;
+  return result;
+}
+
+// Check if the native floppy driver can be used for a disk
+static bool FDC_usable(uint disk)
+{
+  return FDC_enabled && disk < 2 &&
+    disk_info[disk].sectors > 0 &&
+    disk_info[disk].sectors <= FDC_MAX_SECTORS &&
+    disk_info[disk].sides > 0 && disk_info[disk].sides <= 2;
+}
+
+// Read sectors using the track buffer
+// Return NO_ERROR on success
+static uint FDC_readsector(uint disk, uint sector, size_t n, void *buff)
+{
+  const uint spt = disk_info[disk].sectors;
+  const uint sides = disk_info[disk].sides;
+  const bool fits = spt*sides*DISK_SECTOR_SIZE <= FDC_TRACK_SIZE;
+
+  while(n > 0) {
+    chs_t chs = {0};
+    lba_to_chs(sector, spt, sides, &chs);
+    const uint first = chs.head*spt + chs.sector-1;
+
+    // Read only the requested sectors if the cylinder doesn't fit
+    if(!fits) {
+      const uint count = min(min(n, spt*sides - first),
+        FDC_TRACK_SIZE/DISK_SECTOR_SIZE);
+      FDC_track_state.valid = FALSE;
+      const uint result = FDC_transfer(disk, &chs, count, FDC_track, FALSE);
+      if(result != NO_ERROR) {
+        return result;
+      }
+      memcpy(buff, FDC_track, count*DISK_SECTOR_SIZE);
+      sector += count;
+      buff += count*DISK_SECTOR_SIZE;
+      n -= count;
+      continue;
+    }
+
+    // Read the entire cylinder if not buffered
+    // or if the disk was changed
+    FDC_check_changed(disk);
+    if(!FDC_track_state.valid || FDC_track_state.disk != disk ||
+      FDC_track_state.cylinder != chs.cylinder) {
+      const chs_t start = {chs.cylinder, 0, 1};
+      FDC_track_state.valid = FALSE;
+      const uint result = FDC_transfer(disk, &start, spt*sides, FDC_track, FALSE);
+      if(result != NO_ERROR) {
+        return result;
+      }
+      FDC_track_state.valid = TRUE;
+      FDC_track_state.disk = disk;
+      FDC_track_state.cylinder = chs.cylinder;
+    }
+
+    const uint count = min(n, spt*sides - first);
+    memcpy(buff, FDC_track + first*DISK_SECTOR_SIZE, count*DISK_SECTOR_SIZE);
+    sector += count;
+    buff += count*DISK_SECTOR_SIZE;
+    n -= count;
+  }
+
+  return NO_ERROR;
+}
+
+// Write sectors through the track buffer
+// Return NO_ERROR on success
+static uint FDC_writesector(uint disk, uint sector, size_t n, const void *buff)
+{
+  const uint spt = disk_info[disk].sectors;
+  const uint sides = disk_info[disk].sides;
+  const bool fits = spt*sides*DISK_SECTOR_SIZE <= FDC_TRACK_SIZE;
+
+  while(n > 0) {
+    chs_t chs = {0};
+    lba_to_chs(sector, spt, sides, &chs);
+
+    // Buffered cylinder is kept only if it's the written one
+    if(FDC_track_state.disk != disk || FDC_track_state.cylinder != chs.cylinder) {
+      FDC_track_state.valid = FALSE;
+    }
+
+    // Cylinders that don't fit are written in parts
+    // from the start of the track buffer
+    const uint first = chs.head*spt + chs.sector-1;
+    const uint count = fits ? min(n, spt*sides - first) :
+      min(min(n, spt*sides - first), FDC_TRACK_SIZE/DISK_SECTOR_SIZE);
+    uint8_t *data = fits ? FDC_track + first*DISK_SECTOR_SIZE : FDC_track;
+    memcpy(data, buff, count*DISK_SECTOR_SIZE);
+
+    const uint result = FDC_transfer(disk, &chs, count, data, TRUE);
+    if(result != NO_ERROR) {
+      FDC_track_state.valid = FALSE;
+      return result;
+    }
+    sector += count;
+    buff += count*DISK_SECTOR_SIZE;
+    n -= count;
+  }
+
+  return NO_ERROR;
+}
+
+// Initialize floppy disk controller if there are floppy disks
+static void FDC_init()
+{
+  FDC_enabled = FALSE;
+  if(disk_info[0].size == 0 && disk_info[1].size == 0) {
+    return;
+  }
+
+  set_disk_IRQ(FDC_IRQ, IRQFloppy_wrapper);
+  disable_interrupts();
+  FDC_enabled = (FDC_reset() == NO_ERROR);
+  enable_interrupts();
+  debug_putstr("FDC %s\n", FDC_enabled ? "enabled" : "not found");
+}
+
 // Initialize disks info
 void io_disks_init_info()
 {
@@ -973,6 +1745,9 @@ void io_disks_init_info()
   strncpy(disk_info[3].name, "hd1", sizeof(disk_info[3].name));
   strncpy(disk_info[3].desc, "", sizeof(disk_info[3].desc));
 
+  // Find ATA bus master DMA controller
+  ATA_DMA_init();
+
   // Initialize hardware related disks info
   for(uint i=0; i<MAX_DISK; i++) {
     uint hwdisk = disk_info[i].id;
@@ -1018,22 +1793,19 @@ void io_disks_init_info()
     }
   }
 
-  // Set system disk
-  system_disk = hwdisk_to_disk(system_hwdisk);
-}
+  // Use interrupts for ATA disks
+  if(disk_info[2].isATA || disk_info[3].isATA) {
+    set_disk_IRQ(ATA_IRQ_PRIMARY, IRQDisk_wrapper);
+    set_disk_IRQ(ATA_IRQ_SECONDARY, IRQDisk_wrapper);
+    outb(0x3F6, 0);
+    ATA_IRQ_enabled = TRUE;
+  }
 
-typedef struct chs_t {
-  uint cylinder;
-  uint head;
-  uint sector;
-} chs_t;
+  // Use native floppy disk controller
+  FDC_init();
 
-static void lba_to_chs( uint lba, uint spt, uint nh, chs_t *chs)
-{
-  const uint temp = lba / spt;
-  chs->sector = 1 + (lba % spt);
-  chs->head = temp % nh;
-  chs->cylinder = temp / nh;
+  // Set system disk
+  system_disk = hwdisk_to_disk(system_hwdisk);
 }
 
 // Return NO_ERROR on success
@@ -1041,11 +1813,30 @@ static uint disk_read_sector(uint disk, uint sector, size_t n, void *buff)
 {
   uint result = 0;
 
+  // Prefer native floppy controller. If it fails, disable it and use BIOS
+  if(FDC_usable(disk)) {
+    result = FDC_readsector(disk, sector, n, buff);
+    if(result == NO_ERROR) {
+      return result;
+    }
+    FDC_enabled = FALSE;
+  }
+
   // Use ATA PIO for IDE
   if(disk_info[disk].isATA) {
     while(n > 0) {
       const uint n_sectors = min(n,255);
-      result = ATA_PIO_readsector(disk, sector, n_sectors, buff);
+
+      // Prefer DMA. If it fails, disable it and use PIO
+      if(ATA_DMA_usable(buff)) {
+        result = ATA_DMA_transfer(disk, sector, n_sectors, buff, FALSE);
+        if(result != NO_ERROR) {
+          ATA_DMA_base = 0;
+          result = ATA_PIO_readsector(disk, sector, n_sectors, buff);
+        }
+      } else {
+        result = ATA_PIO_readsector(disk, sector, n_sectors, buff);
+      }
       n -= n_sectors;
       sector += n_sectors;
       buff += n_sectors * DISK_SECTOR_SIZE;
@@ -1179,11 +1970,33 @@ static uint disk_write_sector(uint disk, uint sector, size_t n, const void *buff
 {
   uint result = NO_ERROR;
 
+  // Prefer native floppy controller. If it fails, disable it and use BIOS
+  if(FDC_usable(disk)) {
+    result = FDC_writesector(disk, sector, n, buff);
+    if(result == NO_ERROR) {
+      return result;
+    }
+    FDC_enabled = FALSE;
+  }
+
   // Use ATA PIO for IDE
   if(disk_info[disk].isATA) {
+    // Written data can stay in the disk write cache
+    // until io_disk_flush is called
+    ATA_flush_pending[disk] = TRUE;
     while(n > 0) {
       const uint n_sectors = min(n,255);
-      result = ATA_PIO_writesector(disk, sector, n_sectors, buff);
+
+      // Prefer DMA. If it fails, disable it and use PIO
+      if(ATA_DMA_usable(buff)) {
+        result = ATA_DMA_transfer(disk, sector, n_sectors, buff, TRUE);
+        if(result != NO_ERROR) {
+          ATA_DMA_base = 0;
+          result = ATA_PIO_writesector(disk, sector, n_sectors, buff);
+        }
+      } else {
+        result = ATA_PIO_writesector(disk, sector, n_sectors, buff);
+      }
       n -= n_sectors;
       sector += n_sectors;
       buff += n_sectors * DISK_SECTOR_SIZE;
@@ -1316,6 +2129,142 @@ uint io_disk_write(uint disk, uint sector, uint offset, size_t size, const void
   return result;
 }
 
+// Check if media changes of a disk can be detected
+bool io_disk_detects_change(uint disk)
+{
+  // Only floppy disks are removable. The BIOS change
+  // line service is not reliable, so they need the native driver
+  return disk_info[disk].id >= 0x80 || FDC_usable(disk);
+}
+
+// Check if the disk media was changed since the last call
+// Data of the disk cached elsewhere is not valid then
+bool io_disk_changed(uint disk)
+{
+  bool changed = FALSE;
+  disable_interrupts();
+
+  if(FDC_usable(disk)) {
+    // The change line is only valid with the motor on
+    FDC_busy = TRUE;
+    FDC_motor_on(disk);
+    FDC_check_changed(disk);
+    FDC_last_use = io_gettimer();
+    FDC_busy = FALSE;
+    changed = FDC_changed[disk];
+    FDC_changed[disk] = FALSE;
+  } else if(!io_disk_detects_change(disk)) {
+    changed = TRUE;
+  }
+
+  enable_interrupts();
+  return changed;
+}
+
+// Make written data persistent in disk
+// Returns NO_ERROR on success, another value otherwise
+uint io_disk_flush(uint disk)
+{
+  uint result = NO_ERROR;
+  disable_interrupts();
+
+  // BIOS writes are complete when they return
+  if(disk_info[disk].isATA && ATA_flush_pending[disk]) {
+    result = ATA_flush(disk);
+    if(result == NO_ERROR) {
+      ATA_flush_pending[disk] = FALSE;
+    }
+  }
+
+  enable_interrupts();
+  return result;
+}
+
+// Extended memory
+// The BIOS memory map (E820) is read by load.S before
+// switching to protected mode, because it needs 32-bit registers
+typedef struct __attribute__ ((packed)) e820_entry_t {
+  uint32_t base_lo, base_hi;
+  uint32_t length_lo, length_hi;
+  uint32_t type;
+  uint32_t attributes;
+} e820_entry_t;
+
+#define E820_USABLE     1    // Type of usable memory
+#define E820_VALID      0x01 // Attributes: entry is valid
+#define MEM_EXT_MAX     0x40000000 // Max extended memory in bytes
+
+extern e820_entry_t e820_map[];
+extern uint16_t e820_count;
+
+static size_t mem_ext_size = 0;
+
+// Check A20 line. When disabled, addresses wrap at 1MB
+static bool A20_enabled()
+{
+  static volatile uint32_t test = 0;
+  volatile uint32_t *alias = (uint32_t*)((uint)&test + MEM_EXT_BASE);
+  test = 0;
+  *alias = 0xA20A20;
+  const bool enabled = (test == 0);
+  *alias = 0;
+  return enabled;
+}
+
+// Detect extended memory
+void io_mem_init()
+{
+  mem_ext_size = 0;
+
+  // Try the fast A20 gate if BIOS could not enable it
+  if(!A20_enabled()) {
+    outb(0x92, (inb(0x92) | 0x02) & ~0x01);
+    if(!A20_enabled()) {
+      debug_putstr("Memory: A20 line is disabled\n");
+      return;
+    }
+  }
+
+  // Find the usable region which starts at 1MB
+  for(uint i=0; i<e820_count; i++) {
+    const e820_entry_t *e = &e820_map[i];
+    debug_putstr("Memory: E820 base=%x length=%x type=%u\n",
+      e->base_lo, e->length_lo, e->type);
+
+    if(e->type == E820_USABLE && (e->attributes & E820_VALID) &&
+      e->base_hi == 0 && e->base_lo <= MEM_EXT_BASE &&
+      (e->length_hi || e->base_lo + e->length_lo > MEM_EXT_BASE)) {
+      mem_ext_size = (e->length_hi || e->base_lo + e->length_lo < e->base_lo) ?
+        MEM_EXT_MAX : e->base_lo + e->length_lo - MEM_EXT_BASE;
+    }
+  }
+
+  // BIOS without E820. Use E801: memory between 1MB and 16MB
+  // in KB, and memory above 16MB in 64KB blocks
+  if(e820_count == 0) {
+    regs16_t regs = {0};
+    regs.ax = 0xE801;
+    int32(0x15, &regs);
+    if(!(regs.eflags & EFLAG_CF)) {
+      const uint kb_low = regs.cx ? regs.cx : regs.ax;
+      const uint blocks_high = regs.cx ? regs.dx : regs.bx;
+      mem_ext_size = kb_low*1024;
+      if(kb_low == 15*1024) {
+        mem_ext_size += blocks_high*0x10000;
+      }
+    }
+  }
+
+  mem_ext_size = min(mem_ext_size, MEM_EXT_MAX);
+  debug_putstr("Memory: %u KB extended memory\n", mem_ext_size/1024);
+}
+
+// Get extended memory size in bytes
+size_t io_mem_get_extended()
+{
+  return mem_ext_size;
+}
+
 // Power off system using APM
 void apm_shutdown()
 {
@@ -1379,8 +2328,6 @@ void apm_shutdown()
 
 // Enable/disable interrupts
 // Only enabled when there are no locks
-#define INT_NO_LOCK 1
-static volatile uint interrupt_locks = INT_NO_LOCK;
 void enable_interrupts()
 {
   if(interrupt_locks <= INT_NO_LOCK) {
@@ -12,14 +12,18 @@ uint io_getkey(uint wait_mode);
 
 // VGA text mode
 void io_vga_putc(char c, uint8_t attr);
+void io_vga_putstr(const char *str, size_t size, uint8_t attr);
 void io_vga_putc_attr(uint x, uint y, char c, uint8_t attr);
+void io_vga_putrect(uint x, uint y, uint width, uint height,
+  const uint16_t *cells);
 void io_vga_clear();
 void io_vga_getcursorpos(uint *x, uint *y);
 void io_vga_setcursorpos(uint x, uint y);
 void io_vga_showcursor(bool show);
 
-// Put char serial
+// Put char or string serial
 void io_serial_putc(char c);
+void io_serial_putstr(const char *str, size_t size);
 
 // Get time
 void io_getdatetime(time_t *time);
@@ -31,6 +35,21 @@ void io_disks_init_info();
 uint io_disk_read(uint disk, uint sector, uint offset, size_t size, void *buff);
 uint io_disk_write(uint disk, uint sector, uint offset, size_t size, const void *buff);
 
+// Disks may keep written data in a volatile write cache.
+// Flush it, so all written data is persistent
+uint io_disk_flush(uint disk);
+
+// Removable disks media may change.
+// Return TRUE once after a change is detected,
+// or always if changes of the disk can't be detected
+bool io_disk_changed(uint disk);
+bool io_disk_detects_change(uint disk);
+
+// Extended memory: usable memory starting at 1MB
+#define MEM_EXT_BASE 0x100000
+void io_mem_init(); // Detect extended memory
+size_t io_mem_get_extended(); // Get extended memory size in bytes
+
 // Init lapic, including timer
 void lapic_init();
 void lapic_eoi(); // Acknowledge
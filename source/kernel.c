@@ -5,6 +5,8 @@
 #include "hwio.h"
 #include "ulib/ulib.h"
 #include "fs.h"
+#include "cache.h"
+#include "heap.h"
 #include "syscall.h"
 #include "x86.h"
 #include "pci.h"
@@ -15,82 +17,6 @@
 uint8_t system_disk = 0xFF;
 disk_info_t disk_info[MAX_DISK];
 
-// Heap related
-static const void *HEAPADDR = (void*)0x30000; // Allocate heap memory here
-#define HEAP_NUM_BLOCK   0x00020
-#define HEAP_MEM_SIZE    0x40000
-#define HEAP_BLOCK_SIZE  (HEAP_MEM_SIZE / HEAP_NUM_BLOCK)
-
-typedef struct heap_block_t {
-  bool  used;
-  void *ptr;
-} heap_block_t;
-static heap_block_t heap[HEAP_NUM_BLOCK];
-
-// Init heap: all blocks are unused
-static void heap_init()
-{
-  for(uint i=0; i<HEAP_NUM_BLOCK; i++) {
-    heap[i].used = FALSE;
-    heap[i].ptr = NULL;
-  }
-}
-
-// Allocate memory in heap
-static void *heap_alloc(size_t size)
-{
-  if(size == 0) {
-    return NULL;
-  }
-
-  // Get number of blocks to allocate
-  uint n_alloc = size / HEAP_BLOCK_SIZE +
-    ((size % HEAP_BLOCK_SIZE) ? 1 : 0);
-
-  debug_putstr("heap: looking for %u blocks\n", n_alloc);
-
-  // Find a continuous set of n_alloc free blocks
-  uint n_found = 0;
-  for(uint i=0; i<HEAP_NUM_BLOCK; i++) {
-    if(heap[i].used) {
-      debug_putstr("heap: block %u is in use (%u)\n", i, heap[i].used);
-      n_found = 0;
-    } else {
-      n_found++;
-      if(n_found >= n_alloc) {
-        uint bi = (i+1-n_alloc)*HEAP_BLOCK_SIZE;
-        void *addr = (void*)HEAPADDR + bi;
-        for(uint j=i+1-n_alloc; j<=i; j++) {
-          heap[j].ptr = addr;
-          heap[j].used = TRUE;
-        }
-        debug_putstr("heap: found at %x\n", addr);
-        return addr;
-      }
-    }
-  }
-
-  // Error: not found
-  debug_putstr("Mem alloc: BAD ALLOC (%u bytes)\n", size);
-  return NULL;
-}
-
-// Free memory in heap
-static void heap_free(const void *ptr)
-{
-  if(ptr != NULL) {
-    for(uint i=0; i<HEAP_NUM_BLOCK; i++) {
-      if(heap[i].ptr == ptr && heap[i].used) {
-        heap[i].used = FALSE;
-        heap[i].ptr = NULL;
-      }
-    }
-  }
-
-  return;
-}
-
-
 // Handle system calls
 // Usually:
 // -Unpack parameters
@@ -117,6 +43,18 @@ uint kernel_service(uint service, void *param)
       return 0;
     }
 
+    case SYSCALL_IO_OUT_STRING: {
+      syscall_outstr_t *os = param;
+      io_vga_putstr(os->str, os->size, os->attr);
+      return 0;
+    }
+
+    case SYSCALL_IO_OUT_RECT: {
+      syscall_rect_t *r = param;
+      io_vga_putrect(r->x, r->y, r->width, r->height, r->cells);
+      return 0;
+    }
+
     case SYSCALL_IO_OUT_CHAR_ATTR: {
       syscall_posattr_t *pc = param;
       io_vga_putc_attr(pc->x, pc->y, pc->c, pc->attr);
@@ -159,6 +97,13 @@ uint kernel_service(uint service, void *param)
       return 0;
     }
 
+    case SYSCALL_IO_OUT_STRING_SERIAL:
+    case SYSCALL_IO_OUT_STRING_DEBUG: {
+      syscall_outstr_t *os = param;
+      io_serial_putstr(os->str, os->size);
+      return 0;
+    }
+
     case SYSCALL_FS_GET_INFO: {
       syscall_fsinfo_t *fi = param;
       return fs_get_info(fi->disk_index, fi->info);
@@ -192,6 +137,46 @@ uint kernel_service(uint service, void *param)
       return fs_write_file(fi->buff, path, fi->offset, fi->count, fi->flags);
     }
 
+    case SYSCALL_FS_OPEN: {
+      syscall_fsopen_t *fi = param;
+      char path[MAX_PATH] = {0};
+      memcpy(path, fi->path, sizeof(path));
+      return fs_open(path, fi->flags | OF_USER);
+    }
+
+    // User programs can only use their own handles
+    case SYSCALL_FS_READ: {
+      syscall_fshandle_t *fi = param;
+      if(!fs_is_user_file(fi->handle)) {
+        return ERROR_NOT_FOUND;
+      }
+      return fs_read(fi->handle, fi->buff, fi->count);
+    }
+
+    case SYSCALL_FS_WRITE: {
+      syscall_fshandle_t *fi = param;
+      if(!fs_is_user_file(fi->handle)) {
+        return ERROR_NOT_FOUND;
+      }
+      return fs_write(fi->handle, fi->buff, fi->count);
+    }
+
+    case SYSCALL_FS_SEEK: {
+      syscall_fshandle_t *fi = param;
+      if(!fs_is_user_file(fi->handle)) {
+        return ERROR_NOT_FOUND;
+      }
+      return fs_seek(fi->handle, fi->count);
+    }
+
+    case SYSCALL_FS_CLOSE: {
+      const uint handle = *(uint*)param;
+      if(!fs_is_user_file(handle)) {
+        return ERROR_NOT_FOUND;
+      }
+      return fs_close(handle);
+    }
+
     case SYSCALL_FS_MOVE: {
       syscall_fssrcdst_t *fi = param;
       char src[MAX_PATH] = {0};
@@ -240,6 +225,9 @@ uint kernel_service(uint service, void *param)
       return fs_format(*(uint*)param);
     }
 
+    case SYSCALL_FS_SYNC:
+      return cache_sync();
+
     case SYSCALL_DATETIME_GET: {
       io_getdatetime(param);
       return 0;
@@ -251,18 +239,24 @@ uint kernel_service(uint service, void *param)
 
     case SYSCALL_NET_RECV: {
       syscall_netop_t *no = param;
-      return io_net_recv(no->addr, no->buff, no->size);
+      return io_net_recv(no->port, no->addr, no->buff, no->size);
     }
 
     case SYSCALL_NET_SEND: {
       syscall_netop_t *no = param;
-      return io_net_send(no->addr, no->buff, no->size);
+      return io_net_send(no->port, no->addr, no->buff, no->size);
     }
 
     case SYSCALL_NET_PORT: {
-      uint16_t *port = (uint16_t*)param;
-      io_net_recv_set_port(*port);
-      return 0;
+      return io_net_recv_set_port(*(uint16_t*)param);
+    }
+
+    case SYSCALL_NET_BIND: {
+      return io_net_bind(*(uint16_t*)param, TRUE);
+    }
+
+    case SYSCALL_NET_UNBIND: {
+      return io_net_unbind(*(uint16_t*)param, TRUE);
     }
 
     case SYSCALL_SOUND_PLAY: {
@@ -291,12 +285,16 @@ void kernel()
   debug_putstr("nano32 %u.%u build %u\n",
     OS_VERSION_HI, OS_VERSION_LO, OS_BUILD_NUM);
 
-  // Init heap
-  heap_init();
-
   // Init LAPIC
   lapic_init();
 
+  // Detect memory and init heap
+  io_mem_init();
+  heap_init(io_mem_get_extended());
+
+  // Initialize PCI
+  pci_init();
+
   // Init disks info
   io_disks_init_info();
 
@@ -307,9 +305,6 @@ void kernel()
   debug_putstr("system disk: %2x\n",
     system_disk);
 
-  // Initialize PCI
-  pci_init();
-
   // Initialize network
   io_net_init();
 
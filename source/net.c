@@ -6,9 +6,11 @@
 #include "net.h"
 
 /* Network controller
- * Assumes NE2000 compatible nic
+ * Supports NE2000 compatible nics
  * Example: Realtek RTL8019AS
  * http://www.ethernut.de/pdf/8019asds.pdf
+ * Realtek RTL8139 nics
+ * and Intel 82540EM (e1000) nics
  */
 /*
  * The Ne2000 network card uses two ring buffers for packet handling.
@@ -40,13 +42,21 @@
 #define BSWAP_16(value) \
 ((((value) & 0xFF) << 8) | (((value)&0xFF00) >> 8))
 
-#define NUM_COMPATIBLE_DEVICES 1
-static struct device_id_t {
-  uint16_t  vendor_id;
-  uint16_t  device_id;
-} const ne2k_compatible[NUM_COMPATIBLE_DEVICES] = {
-  {0x10EC, 0x8029} // Realtek
-};
+// Nic driver. The supported ones are listed in supported_nic
+typedef struct nic_t {
+  const char *name;
+  uint16_t    vendor_id;
+  uint16_t    device_id;
+  uint        flags;                        // See NIC_ flags
+  bool (*init)(PCI_device_t *pdev);         // Reset, set local_mac, start
+  uint (*send)(uint8_t *frame, size_t len); // Send a full frame
+  void (*handler)();                        // Handle interrupts
+} nic_t;
+
+// nic_t flags
+#define NIC_TX_CSUM 0x01 // IP and UDP checksums are computed by the nic
+
+static const nic_t *nic = NULL; // Found nic
 
 // Registers
 #define NE2K_CR       0x00 // Command register
@@ -121,8 +131,180 @@ static struct device_id_t {
 #define NE2K_IMR_CNTE 0x20  // Counter Overflow Interrupt Enable
 #define NE2K_IMR_RDCE 0x40  // Remote DMA Complete Interrupt Enable
 
+// Nic memory pages (256 bytes each). Two transmit slots, each one
+// big enough for a full frame, followed by the reception ring
+#define NE2K_TX_START 0x40 // First transmit slot page
+#define NE2K_TX_PAGES 6    // Pages per transmit slot
+#define NE2K_RX_START (NE2K_TX_START + 2*NE2K_TX_PAGES)
+#define NE2K_RX_STOP  0x80
+
+// RTL8139 registers
+#define RTL_IDR0     0x00 // MAC address
+#define RTL_TSD0     0x10 // Transmit status of descriptor 0 (4 bytes each)
+#define RTL_TSAD0    0x20 // Transmit address of descriptor 0 (4 bytes each)
+#define RTL_RBSTART  0x30 // Receive buffer start address
+#define RTL_CR       0x37 // Command
+#define RTL_CAPR     0x38 // Current address of packet read
+#define RTL_IMR      0x3C // Interrupt mask
+#define RTL_ISR      0x3E // Interrupt status
+#define RTL_TCR      0x40 // Transmit config
+#define RTL_RCR      0x44 // Receive config
+#define RTL_CONFIG1  0x52 // Configuration
+
+// RTL_CR bits
+#define RTL_CR_BUFE  0x01 // Receive buffer empty
+#define RTL_CR_TE    0x04 // Transmitter enable
+#define RTL_CR_RE    0x08 // Receiver enable
+#define RTL_CR_RST   0x10 // Reset
+
+// RTL_ISR and RTL_IMR bits
+#define RTL_INT_ROK   0x0001 // Receive ok
+#define RTL_INT_RER   0x0002 // Receive error
+#define RTL_INT_TOK   0x0004 // Transmit ok
+#define RTL_INT_TER   0x0008 // Transmit error
+#define RTL_INT_RXOVW 0x0010 // Receive buffer overflow
+#define RTL_INT_FOVW  0x0040 // Receive FIFO overflow
+
+#define RTL_TSD_OWN   0x2000 // Frame fetched by the nic
+#define RTL_RX_ROK    0x0001 // Received packet status: ok
+
+// Receive: accept broadcast and physical match, 8KB ring,
+// don't wrap packets at its end, unlimited DMA burst
+#define RTL_RCR_CONFIG 0x0000078A
+// Transmit: standard interframe gap, 2KB DMA burst
+#define RTL_TCR_CONFIG 0x03000700
+
+// Buffers in host memory. The nic writes packets
+// past the end of the receive ring instead of wrapping them
+#define RTL_RX_ADDRESS   0x8E000 // Linear memory address
+#define RTL_RX_RING_LEN  8192    // Size of the ring
+#define RTL_TX_ADDRESS   0x91000 // Linear memory address
+#define RTL_TX_DESCS     4       // Number of transmit descriptors
+#define RTL_TX_BUFF_LEN  1536    // Buffer size of each descriptor
+
+static uint rtl_rx_offset = 0; // Next packet in the receive ring
+static uint rtl_tx_next = 0;   // Next transmit descriptor to use
+
+// e1000 registers (memory mapped)
+#define E1000_CTRL    0x0000 // Device control
+#define E1000_ICR     0x00C0 // Interrupt cause read
+#define E1000_ITR     0x00C4 // Interrupt throttling
+#define E1000_IMS     0x00D0 // Interrupt mask set
+#define E1000_IMC     0x00D8 // Interrupt mask clear
+#define E1000_RCTL    0x0100 // Receive control
+#define E1000_TCTL    0x0400 // Transmit control
+#define E1000_TIPG    0x0410 // Transmit inter packet gap
+#define E1000_RDBAL   0x2800 // Receive descriptors base address
+#define E1000_RDBAH   0x2804
+#define E1000_RDLEN   0x2808 // Receive descriptors length in bytes
+#define E1000_RDH     0x2810 // Receive descriptor head
+#define E1000_RDT     0x2818 // Receive descriptor tail
+#define E1000_TDBAL   0x3800 // Transmit descriptors base address
+#define E1000_TDBAH   0x3804
+#define E1000_TDLEN   0x3808 // Transmit descriptors length in bytes
+#define E1000_TDH     0x3810 // Transmit descriptor head
+#define E1000_TDT     0x3818 // Transmit descriptor tail
+#define E1000_RXCSUM  0x5000 // Receive checksum control
+#define E1000_MTA     0x5200 // Multicast table array
+#define E1000_RAL0    0x5400 // Receive address low
+#define E1000_RAH0    0x5404 // Receive address high
+
+#define E1000_MTA_LEN 128 // Multicast table entries
+
+#define E1000_CTRL_SLU  0x00000040 // Set link up
+#define E1000_CTRL_RST  0x04000000 // Reset
+#define E1000_RAH_AV    0x80000000 // Address valid
+
+// Receive: enable, accept broadcast, 2KB buffers, strip CRC
+#define E1000_RCTL_EN    0x00000002
+#define E1000_RCTL_BAM   0x00008000
+#define E1000_RCTL_SECRC 0x04000000
+#define E1000_RXCSUM_IPOFLD 0x0100 // Check IP checksums
+#define E1000_RXCSUM_TUOFLD 0x0200 // Check TCP/UDP checksums
+
+// Transmit: enable, pad short packets, standard collision
+// threshold and distance, and inter packet gap
+#define E1000_TCTL_CONFIG 0x0004010A
+#define E1000_TIPG_CONFIG 0x0060200A
+
+// Interrupts
+#define E1000_INT_RXDMT0 0x0010 // Receive descriptors minimum threshold
+#define E1000_INT_RXO    0x0040 // Receiver overrun
+#define E1000_INT_RXT0   0x0080 // Receiver timer
+#define E1000_ITR_INTERVAL 500 // Min time between interrupts (256ns units)
+
+// Descriptors
+typedef struct e1000_rx_desc_t {
+  uint32_t addr_lo;
+  uint32_t addr_hi;
+  uint16_t length;
+  uint16_t checksum;
+  uint8_t  status;
+  uint8_t  errors;
+  uint16_t special;
+} e1000_rx_desc_t;
+
+typedef struct e1000_data_desc_t {
+  uint32_t addr_lo;
+  uint32_t addr_hi;
+  uint32_t cmd_len; // Length, type and command
+  uint8_t  status;
+  uint8_t  popts;   // Checksum options
+  uint16_t special;
+} e1000_data_desc_t;
+
+typedef struct e1000_context_desc_t {
+  uint8_t  ipcss;   // IP checksum start
+  uint8_t  ipcso;   // IP checksum offset
+  uint16_t ipcse;   // IP checksum end
+  uint8_t  tucss;   // TCP/UDP checksum start
+  uint8_t  tucso;   // TCP/UDP checksum offset
+  uint16_t tucse;   // TCP/UDP checksum end
+  uint32_t cmd_len; // Length, type and command
+  uint8_t  status;
+  uint8_t  hdrlen;
+  uint16_t mss;
+} e1000_context_desc_t;
+
+#define E1000_DESC_DD      0x01 // Status: descriptor done
+#define E1000_DESC_EOP     0x02 // Status: end of packet
+#define E1000_DTYP_CONTEXT 0x00000000
+#define E1000_DTYP_DATA    0x00100000
+#define E1000_DCMD_EOP     0x01000000 // End of packet
+#define E1000_DCMD_IFCS    0x02000000 // Insert CRC
+#define E1000_TUCMD_IP     0x02000000 // Context: IPv4 packets
+#define E1000_DCMD_RS      0x08000000 // Report status
+#define E1000_DCMD_DEXT    0x20000000 // Extended descriptor
+#define E1000_POPTS_IXSM   0x01 // Insert IP checksum
+#define E1000_POPTS_TXSM   0x02 // Insert TCP/UDP checksum
+
+// Rings and buffers in host memory. Ring sizes
+// must be multiples of 128 bytes
+#define E1000_RX_DESC_ADDRESS 0x8E000 // Linear memory address
+#define E1000_TX_DESC_ADDRESS 0x8E100 // Linear memory address
+#define E1000_RX_BUFF_ADDRESS 0x8F000 // Linear memory address
+#define E1000_TX_BUFF_ADDRESS 0x97000 // Linear memory address
+#define E1000_RX_DESCS        16      // Number of receive descriptors
+#define E1000_TX_DESCS        8       // Number of transmit descriptors
+#define E1000_BUFF_LEN        2048    // Buffer size of each descriptor
+
+static e1000_rx_desc_t *const e1000_rx_desc =
+  (e1000_rx_desc_t*)E1000_RX_DESC_ADDRESS;
+static e1000_data_desc_t *const e1000_tx_desc =
+  (e1000_data_desc_t*)E1000_TX_DESC_ADDRESS;
+static uint e1000_rx_next = 0; // Next receive descriptor to process
+static uint e1000_tx_next = 0; // Next transmit descriptor to use
+
 // Store here current reception page
-static uint rx_next = 0x47;
+static uint rx_next = NE2K_RX_START + 1;
+
+// Transmit slots. While a frame is on the wire, the next
+// one is loaded in the other slot, and sent when the nic
+// signals the end of the first transmission
+static uint tx_len[2] = {0};  // Loaded frame size. 0 if slot is free
+static uint tx_load = 0;      // Next slot to load
+static uint tx_current = 0;   // Slot being transmitted
+static bool tx_busy = FALSE;  // Transmission in progress
 
 // Is network enabled
 static uint network_state = NET_STATE_UNINITIALIZED;
@@ -140,19 +322,47 @@ static uint8_t local_net[IP_LEN] = {255,255,255,0}; // Default value
 // Default send/recv port
 #define UDP_SEND_PORT 8086
 
-// Enable reception only in rcv_port
+// Default reception port. See io_net_recv_set_port
 static uint16_t rcv_port = UDP_SEND_PORT;
 
-// Buffer to send/receive packets
+// Frame buffers. Transmission: a full MTU frame. The nic appends
+// the CRC. Reception: a full MTU frame and its CRC
+static uint8_t   snd_buff[1514] = {0};
+static uint8_t   tmp_buff[1522] = {0};
+
+// Sockets: bound UDP ports, each one with its reception queue.
+// Queues are rings of received packets, filled by the IRQ
+// handler and drained by io_net_recv
+#define NET_RX_QUEUE_ADDRESS 0x80000 // Linear memory address
+#define NET_RX_QUEUE_LEN     8       // Packets per socket
 typedef struct netpacket_t {
   net_address_t addr;
   size_t        size;
-  uint8_t       buff[256];
+  uint8_t       buff[1500];
 } netpacket_t;
 
-static netpacket_t rcv_buff;
-static uint8_t   snd_buff[256] = {0};
-static uint8_t   tmp_buff[256] = {0};
+typedef struct socket_t {
+  uint16_t      port;  // Bound port. 0 if socket is free
+  bool          user;  // Bound by a user program
+  volatile uint head;  // Next packet to fill
+  volatile uint tail;  // Next packet to drain
+  netpacket_t  *queue;
+} socket_t;
+
+static socket_t socket[NET_MAX_SOCKETS];
+static net_stats_t stats = {0};
+
+// Find the socket bound to a port
+// Returns NULL if not found
+static socket_t *find_socket(uint16_t port)
+{
+  for(uint i=0; i<NET_MAX_SOCKETS; i++) {
+    if(port != 0 && socket[i].port == port) {
+      return &socket[i];
+    }
+  }
+  return NULL;
+}
 
 // Ethernet related
 typedef struct eth_hdr_t {
@@ -171,6 +381,7 @@ typedef struct eth_hdr_t {
 #define ETH_MTU       1500
 #define ETH_VLAN_LEN  4
 #define ETH_CRC_LEN   4
+#define ETH_MIN_LEN   60 // Shorter frames are padded
 
 #define ETH_PKT_MAX_LEN  (ETH_HDR_LEN+ETH_VLAN_LEN+ETH_MTU)
 
@@ -226,12 +437,57 @@ typedef struct udp_hdr_t {
   uint16_t checksum;
 } udp_hdr_t;
 
-// ARP table to hold IP-MAC entries
-#define ARP_TABLE_LEN 8
-static struct arp_table_struct {
+// Transmission buffers reserve room before the payload for the
+// headers of the lower layers, so they can be prepended to it
+#define ETH_HEADROOM (sizeof(eth_hdr_t))
+#define IP_HEADROOM  (ETH_HEADROOM + sizeof(ip_hdr_t))
+#define UDP_HEADROOM (IP_HEADROOM + sizeof(udp_hdr_t))
+
+// ARP table to hold IP-MAC entries.
+// Entries are found hashing the IP and probing a few consecutive
+// slots. Resolved entries are refreshed when used after
+// ARP_REFRESH_AGE, and not used anymore after ARP_EXPIRE_AGE
+#define ARP_TABLE_LEN     64     // Must be a power of 2
+#define ARP_TABLE_PROBES  4      // Slots where an IP can be
+#define ARP_RETRY_PERIOD  1000   // Miliseconds between requests
+#define ARP_RETRIES       3      // Requests before giving up
+#define ARP_REFRESH_AGE   240000 // Miliseconds
+#define ARP_EXPIRE_AGE    300000 // Miliseconds
+
+enum ARP_STATE {
+  ARP_FREE = 0,
+  ARP_PENDING,  // Requested, waiting for reply
+  ARP_RESOLVED
+};
+
+typedef struct arp_entry_t {
   uint8_t ip[IP_LEN];
   uint8_t mac[MAC_LEN];
-} arp_table[ARP_TABLE_LEN];
+  uint8_t state;
+  uint8_t retries;  // Requests sent while pending
+  uint    time;     // Resolution time
+  uint    req_time; // Last request time
+} arp_entry_t;
+
+static arp_entry_t arp_table[ARP_TABLE_LEN];
+
+static const uint8_t broadcast_mac[MAC_LEN] = {
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+// Packets waiting for the hardware address of their next hop.
+// Stored as IP packets preceded by ETH_HEADROOM
+#define NET_ARP_QUEUE_ADDRESS 0x8C000 // Linear memory address
+#define ARP_QUEUE_LEN         4       // Number of packets
+typedef struct arp_pending_t {
+  arp_entry_t *entry; // Entry being resolved. NULL if slot is free
+  size_t       len;
+  uint8_t      buff[1514];
+} arp_pending_t;
+
+static arp_pending_t *const arp_queue = (arp_pending_t*)NET_ARP_QUEUE_ADDRESS;
+static uint arp_queued = 0; // Number of used arp_queue slots
+static uint8_t arp_buff[ETH_MIN_LEN] = {0}; // ARP frames buffer
 
 // Given an IP address, provide effective IP address to send packet
 static uint8_t *get_effective_ip(uint8_t *ip)
@@ -251,136 +507,100 @@ static uint8_t *get_effective_ip(uint8_t *ip)
   return ip;
 }
 
-// Given an IP address, provide MAC address
-// if found in the translation table
-static uint8_t *find_mac_in_table(uint8_t *ip)
+// First ARP table slot of an IP
+static uint arp_hash(const uint8_t *ip)
 {
-  // Local IP -> local MAC
-  if(memcmp(ip, local_ip, sizeof(local_ip)) == 0) {
-    return local_mac;
-  }
+  return (ip[0] ^ ip[1] ^ (ip[2]*31) ^ (ip[3]*7)) & (ARP_TABLE_LEN-1);
+}
 
-  // Otherwise search in the table
-  for(uint i=0; i<ARP_TABLE_LEN; i++) {
-    if(memcmp(arp_table[i].ip, ip,
-      sizeof(arp_table[i].ip)) == 0) {
-      return arp_table[i].mac;
+// Find the ARP table entry of an IP
+// Returns NULL if not found
+static arp_entry_t *arp_find(const uint8_t *ip)
+{
+  const uint h = arp_hash(ip);
+  for(uint i=0; i<ARP_TABLE_PROBES; i++) {
+    arp_entry_t *e = &arp_table[(h+i) & (ARP_TABLE_LEN-1)];
+    if(e->state != ARP_FREE && memcmp(e->ip, ip, sizeof(e->ip)) == 0) {
+      return e;
     }
   }
-  return 0;
+  return NULL;
 }
 
-// Keep checksum 16-bits
-static uint16_t net_checksum_final(uint32_t sum)
+// Create an ARP table entry for an IP, in a free slot
+// or replacing the oldest resolved one.
+// Returns NULL if all slots are pending
+static arp_entry_t *arp_new_entry(const uint8_t *ip)
 {
-  sum = (sum&0xFFFF) + (sum>>16);
+  const uint now = io_gettimer();
+  const uint h = arp_hash(ip);
+  arp_entry_t *e = NULL;
+  for(uint i=0; i<ARP_TABLE_PROBES; i++) {
+    arp_entry_t *c = &arp_table[(h+i) & (ARP_TABLE_LEN-1)];
+    if(c->state == ARP_FREE) {
+      e = c;
+      break;
+    }
+    if(c->state == ARP_RESOLVED &&
+      (e == NULL || now - c->time > now - e->time)) {
+      e = c;
+    }
+  }
 
-  uint16_t temp = ~sum;
-  return ((temp&0x00FF)<<8) | ((temp&0xFF00)>>8);
+  if(e) {
+    memset(e, 0, sizeof(arp_entry_t));
+    memcpy(e->ip, ip, sizeof(e->ip));
+  }
+  return e;
 }
 
-// Checksum accumulation function
-static uint32_t net_checksum_acc(uint8_t *data, uint32_t len)
+// Fold checksum accumulation to 16-bits
+static uint16_t net_checksum_fold(uint32_t sum)
 {
-  uint32_t sum = 0;
-  uint16_t *p = (uint16_t*)data;
-
-  while(len > 1) {
-    sum += *p++;
-    len -= 2;
-  }
-
-  if(len) {
-    sum += *(uint8_t*)p;
+  while(sum >> 16) {
+    sum = (sum&0xFFFF) + (sum>>16);
   }
-
   return sum;
 }
 
+// Keep checksum 16-bits
+static uint16_t net_checksum_final(uint32_t sum)
+{
+  uint16_t temp = ~net_checksum_fold(sum);
+  return ((temp&0x00FF)<<8) | ((temp&0xFF00)>>8);
+}
+
 // Main checksum function
 static uint16_t net_checksum(uint8_t *data, uint len)
 {
-  uint32_t sum = net_checksum_acc(data, len);
+  uint32_t sum = checksum_acc(0, data, len);
   return net_checksum_final(sum);
 }
 
-// This helps calculating CRC
-static uint32_t poly8_lookup[256] =
-{
- 0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA,
- 0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3,
- 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
- 0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91,
- 0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE,
- 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
- 0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC,
- 0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5,
- 0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172,
- 0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B,
- 0x35B5A8FA, 0x42B2986C, 0xDBBBC9D6, 0xACBCF940,
- 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
- 0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116,
- 0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
- 0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924,
- 0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D,
- 0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A,
- 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
- 0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818,
- 0x7F6A0DBB, 0x086D3D2D, 0x91646C97, 0xE6635C01,
- 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
- 0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457,
- 0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA, 0xFCB9887C,
- 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
- 0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2,
- 0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB,
- 0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0,
- 0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
- 0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086,
- 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
- 0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4,
- 0x59B33D17, 0x2EB40D81, 0xB7BD5C3B, 0xC0BA6CAD,
- 0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
- 0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683,
- 0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8,
- 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
- 0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE,
- 0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7,
- 0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
- 0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5,
- 0xD6D6A3E8, 0xA1D1937E, 0x38D8C2C4, 0x4FDFF252,
- 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
- 0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60,
- 0xDF60EFC3, 0xA867DF55, 0x316E8EEF, 0x4669BE79,
- 0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236,
- 0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F,
- 0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04,
- 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
- 0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A,
- 0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713,
- 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38,
- 0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21,
- 0x86D3D2D4, 0xF1D4E242, 0x68DDB3F8, 0x1FDA836E,
- 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
- 0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C,
- 0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
- 0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2,
- 0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB,
- 0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0,
- 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
- 0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6,
- 0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
- 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
- 0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
-};
+// Checksum partial sum of a pseudo header: source and
+// destination IP, protocol and length. Computed from
+// the values, without building the header
+static uint32_t net_checksum_pseudo(const uint8_t *src_ip,
+  const uint8_t *dst_ip, uint8_t protocol, uint16_t len)
+{
+  uint32_t sum = checksum_acc(0, src_ip, IP_LEN);
+  sum = checksum_acc(sum, dst_ip, IP_LEN);
+
+  // Words in memory byte order: (0, protocol) and len
+  const uint32_t words = BSWAP_16(protocol) + BSWAP_16(len);
+  sum += words;
+  return sum + (sum < words); // Carry
+}
 
-// Calculate a checksum on a buffer
-static uint32_t crc32_byte(uint8_t *p, uint32_t bytelength)
+// Update a checksum when a 16-bit field changes
+// from old_value to new_value (RFC 1624 eqn. 3):
+// HC' = ~(~HC + ~m + m')
+// All values in memory byte order
+static uint16_t net_checksum_update(uint16_t checksum,
+  uint16_t old_value, uint16_t new_value)
 {
-  uint32_t crc = 0xFFFFFFFFL;
-  while(bytelength-- !=0) {
-    crc = (poly8_lookup[((uint8_t)(crc&0xFF)^(*(p++)))] ^ (crc>>8));
-  }
-  return (~crc);
+  const uint32_t sum = (uint16_t)~checksum + (uint16_t)~old_value + new_value;
+  return ~net_checksum_fold(sum);
 }
 
 // Select a registers page in the ne2k
@@ -391,24 +611,60 @@ static void ne2k_page_select(uint page)
   outb(base + NE2K_CR, (pg|cm));
 }
 
+// Start transmission of a loaded slot
+static void ne2k_transmit(uint slot)
+{
+  ne2k_page_select(0);
+  outb(base + NE2K_TPSR, NE2K_TX_START + slot*NE2K_TX_PAGES);
+  outb(base + NE2K_TBCR0, (tx_len[slot] & 0xFF));
+  outb(base + NE2K_TBCR1, ((tx_len[slot] >> 8) & 0xFF));
+  outb(base + NE2K_CR, 0x26); // Abort/Complete DMA + Transmit + Start
+  tx_current = slot;
+  tx_busy = TRUE;
+}
+
+// Transmission finished (or aborted): free its slot
+// and send the other one if it's loaded
+static void ne2k_transmit_done()
+{
+  if(!tx_busy) {
+    return;
+  }
+  tx_len[tx_current] = 0;
+  tx_busy = FALSE;
+  if(tx_len[tx_current ^ 1]) {
+    ne2k_transmit(tx_current ^ 1);
+  }
+}
+
 // Send network packet (hardware, ne2k)
+// Must be called with interrupts disabled
 static uint ne2k_send(uint8_t *data, size_t len)
 {
-  while(inb(base + NE2K_CR) == 0x26) { // Abort/Complete DMA + Transmit + Start
+  // Both slots are used: wait for the current transmission
+  while(tx_len[tx_load]) {
+    const uint8_t isr = inb(base + NE2K_ISR) & (NE2K_STAT_TX|NE2K_STAT_TXE);
+    if(isr) {
+      outb(base + NE2K_ISR, isr);
+      ne2k_transmit_done();
+    }
   }
 
   // Prepare buffer and size
+  // Transfers are word sized: count must be even
+  const size_t count = (len + 1) & ~1;
   ne2k_page_select(0);
   outb(base + NE2K_RSAR0, 0);
-  outb(base + NE2K_RSAR1, 0x40);
-  outb(base + NE2K_RBCR0, len & 0xFF);
-  outb(base + NE2K_RBCR1, (len >> 8) & 0xFF);
+  outb(base + NE2K_RSAR1, NE2K_TX_START + tx_load*NE2K_TX_PAGES);
+  outb(base + NE2K_RBCR0, count & 0xFF);
+  outb(base + NE2K_RBCR1, (count >> 8) & 0xFF);
 
   outb(base + NE2K_CR, 0x12);  // Start write
 
-  // Load buffer
-  for(uint i=0; i<len; i++) {
-    outb(base + NE2K_DATA, data[i]);
+  // Load buffer. Odd last byte is padded
+  outsw(base + NE2K_DATA, data, len/2);
+  if(len & 1) {
+    outw(base + NE2K_DATA, data[len-1]);
   }
 
   // Wait until operation completed
@@ -417,37 +673,40 @@ static uint ne2k_send(uint8_t *data, size_t len)
 
   outb(base + NE2K_ISR, NE2K_STAT_RDC); // Clear completed bit
 
-  outb(base + NE2K_TPSR, 0x40);
-  outb(base + NE2K_TBCR0, (len & 0xFF));
-  outb(base + NE2K_TBCR1, ((len >> 8) & 0xFF));
-  outb(base + NE2K_CR, 0x26); // Abort/Complete DMA + Transmit + Start
+  // Transmit now or after the current transmission
+  tx_len[tx_load] = len;
+  if(!tx_busy) {
+    ne2k_transmit(tx_load);
+  }
+  tx_load ^= 1;
 
   return NO_ERROR;
 }
 
 // Send network packet (ethernet)
-static uint eth_send(uint8_t *dst_mac, uint type, uint8_t *data, size_t len)
+// data must be preceded by ETH_HEADROOM bytes, where the header is
+// written, and its buffer must be at least ETH_MIN_LEN bytes long
+static uint eth_send(const uint8_t *dst_mac, uint type, uint8_t *data, size_t len)
 {
-  const size_t head_len = sizeof(eth_hdr_t);
-  eth_hdr_t *eh = (eth_hdr_t*)data;
-
-  memcpy(eh->data, data, len);
+  eth_hdr_t *eh = (eth_hdr_t*)(data - ETH_HEADROOM);
   memcpy(eh->dst, dst_mac, sizeof(eh->dst));
   memcpy(eh->src, local_mac, sizeof(eh->src));
   eh->type = BSWAP_16(type);
 
-  uint32_t eth_crc = crc32_byte(data, head_len+len);
-  memcpy(&eh->data[len], &eth_crc, sizeof(eth_crc));
-  return ne2k_send(data, len + head_len + ETH_CRC_LEN);
+  // Pad short frames. CRC is appended by the nic
+  len += ETH_HEADROOM;
+  if(len < ETH_MIN_LEN) {
+    memset(&eh->data[len-ETH_HEADROOM], 0, ETH_MIN_LEN-len);
+    len = ETH_MIN_LEN;
+  }
+  return nic->send((uint8_t*)eh, len);
 }
 
 // Request mac address given an IP
-static uint arp_request(uint8_t *ip)
+// Requesting the local IP announces it (gratuitous ARP)
+static uint arp_request(const uint8_t *ip)
 {
-  uint8_t broadcast_mac[MAC_LEN];
-  memset(broadcast_mac, 0xFF, sizeof(broadcast_mac));
-
-  arp_hdr_t *ah = (arp_hdr_t*)snd_buff;
+  arp_hdr_t *ah = (arp_hdr_t*)&arp_buff[ETH_HEADROOM];
   ah->hrd = BSWAP_16(ARP_HTYPE_ETHER);
   ah->pro = BSWAP_16(ARP_PTYPE_IP);
   ah->hln = MAC_LEN;
@@ -458,13 +717,13 @@ static uint arp_request(uint8_t *ip)
   memcpy(ah->dha, broadcast_mac, sizeof(ah->dha));
   memcpy(ah->dpa, ip, sizeof(ah->dpa));
   const size_t head_len = sizeof(arp_hdr_t);
-  return eth_send(broadcast_mac, ETH_TYPE_ARP, snd_buff, head_len);
+  return eth_send(broadcast_mac, ETH_TYPE_ARP, (uint8_t*)ah, head_len);
 }
 
 // Reply an ARP request with local mac address
-static uint arp_reply(uint8_t *mac, uint8_t *ip)
+static uint arp_reply(const uint8_t *mac, const uint8_t *ip)
 {
-  arp_hdr_t *ah = (arp_hdr_t*)snd_buff;
+  arp_hdr_t *ah = (arp_hdr_t*)&arp_buff[ETH_HEADROOM];
 
   ah->hrd = BSWAP_16(ARP_HTYPE_ETHER);
   ah->pro = BSWAP_16(ARP_PTYPE_IP);
@@ -476,196 +735,322 @@ static uint arp_reply(uint8_t *mac, uint8_t *ip)
   memcpy(ah->dha, mac, sizeof(ah->dha));
   memcpy(ah->dpa, ip, sizeof(ah->dpa));
   const size_t head_len = sizeof(arp_hdr_t);
-  return eth_send(mac, ETH_TYPE_ARP, snd_buff, head_len);
+  return eth_send(mac, ETH_TYPE_ARP, (uint8_t*)ah, head_len);
 }
 
-// Send IP packet
-static uint ip_send(uint8_t *dst_ip, uint8_t protocol, uint8_t *data, size_t len)
+// Send an IP packet to the hardware address of ip.
+// If it's unknown or expired, queue the packet and request it.
+// Never waits. Must be called with interrupts disabled.
+// data must be preceded by ETH_HEADROOM bytes
+static uint arp_send_ip(const uint8_t *ip, uint8_t *data, size_t len)
 {
-  const size_t head_len = sizeof(ip_hdr_t);
-  ip_hdr_t *ih = (ip_hdr_t*)data;
-  static uint id = 0;
-  id++;
+  const uint now = io_gettimer();
+
+  // Local IP -> local MAC
+  if(memcmp(ip, local_ip, sizeof(local_ip)) == 0) {
+    return eth_send(local_mac, ETH_TYPE_IP, data, len);
+  }
+
+  arp_entry_t *e = arp_find(ip);
+  if(e && e->state == ARP_RESOLVED && now - e->time < ARP_EXPIRE_AGE) {
+    // Refresh in advance, still using the current address
+    if(now - e->time >= ARP_REFRESH_AGE &&
+      now - e->req_time >= ARP_RETRY_PERIOD) {
+      e->req_time = now;
+      arp_request(ip);
+    }
+    return eth_send(e->mac, ETH_TYPE_IP, data, len);
+  }
 
-  memcpy(&(data[head_len]), data, len);
-  ih->ver_ihl = (4<<4) | 5;
-  ih->tos = 0;
-  ih->len = BSWAP_16(len+head_len);
-  ih->id = BSWAP_16(id);
-  ih->offset = BSWAP_16(0);
-  ih->ttl = 128;
-  ih->protocol = protocol;
-  ih->checksum = 0;
-  memcpy(ih->src, local_ip, sizeof(ih->src));
-  memcpy(ih->dst, dst_ip, sizeof(ih->dst));
+  // Find a free queue slot
+  uint q = 0;
+  while(q < ARP_QUEUE_LEN && arp_queue[q].entry != NULL) {
+    q++;
+  }
+  if(e == NULL) {
+    e = arp_new_entry(ip);
+  }
+  if(q == ARP_QUEUE_LEN || e == NULL) {
+    stats.tx_unresolved++;
+    debug_putstr("net: ARP: queue is full. Packet to %d.%d.%d.%d discarded\n",
+      ip[0], ip[1], ip[2], ip[3]);
+    return ERROR_NO_SPACE;
+  }
 
-  const uint checksum = net_checksum(data, head_len);
-  ih->checksum = BSWAP_16(checksum);
+  // Queue packet
+  arp_queue[q].entry = e;
+  arp_queue[q].len = len;
+  memcpy(&arp_queue[q].buff[ETH_HEADROOM], data, len);
+  arp_queued++;
+  stats.tx_arp_queued++;
 
-  // Try to find hw address in table
-  uint8_t *dst_mac = find_mac_in_table(get_effective_ip(dst_ip));
+  // Request address if not already requested
+  if(e->state != ARP_PENDING) {
+    debug_putstr("net: Requesting mac for %d.%d.%d.%d...\n",
+      ip[0], ip[1], ip[2], ip[3]);
+    e->state = ARP_PENDING;
+    e->retries = 1;
+    e->req_time = now;
+    arp_request(ip);
+  }
+  return NO_ERROR;
+}
 
-  // Unsuccessful
-  if(dst_mac == NULL) {
-    debug_putstr("net: IP: Can't find hw address for %d.%d.%d.%d. Aborted\n",
-      dst_ip[0], dst_ip[1], dst_ip[2], dst_ip[3]);
-    return ERROR_IO;
+// Set the hardware address of an IP, creating the entry if
+// create is true, and send the packets waiting for it.
+// Must be called with interrupts disabled
+static void arp_update(const uint8_t *ip, const uint8_t *mac, bool create)
+{
+  arp_entry_t *e = arp_find(ip);
+  if(e == NULL && create) {
+    e = arp_new_entry(ip);
+  }
+  if(e == NULL) {
+    return;
   }
 
-  return eth_send(dst_mac, ETH_TYPE_IP, data, head_len+len);
+  memcpy(e->mac, mac, sizeof(e->mac));
+  e->state = ARP_RESOLVED;
+  e->time = io_gettimer();
+  e->retries = 0;
+  debug_putstr("net: ARP: updated: %d.%d.%d.%d : %2x:%2x:%2x:%2x:%2x:%2x\n",
+    ip[0], ip[1], ip[2], ip[3],
+    mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+
+  for(uint q=0; q<ARP_QUEUE_LEN; q++) {
+    if(arp_queue[q].entry == e) {
+      eth_send(e->mac, ETH_TYPE_IP, &arp_queue[q].buff[ETH_HEADROOM],
+        arp_queue[q].len);
+      arp_queue[q].entry = NULL;
+      arp_queued--;
+    }
+  }
 }
 
-// Ensure mac address is in table
-// Ask for it, if it isn't
-static uint provide_mac_address(uint8_t *ip)
+// Retry pending requests and discard packets whose
+// address could not be resolved. Called by the timer handler
+void io_net_timer()
 {
-  // Get effective address
-  ip = get_effective_ip(ip);
+  if(arp_queued == 0) {
+    return;
+  }
 
-  // Find in table
-  uint8_t *mac = find_mac_in_table(ip);
+  // The nic, arp_buff and the ARP tables are shared with
+  // the network handler and io_net_send
+  disable_interrupts();
+  const uint now = io_gettimer();
+  for(uint q=0; q<ARP_QUEUE_LEN; q++) {
+    arp_entry_t *e = arp_queue[q].entry;
+    if(e == NULL || now - e->req_time < ARP_RETRY_PERIOD) {
+      continue;
+    }
 
-  // If not found, request
-  uint i = 0;
-  while(mac==NULL && i<16) {
-    debug_putstr("net: Requesting mac for %d.%d.%d.%d...\n",
-      ip[0], ip[1], ip[2], ip[3]);
+    if(e->retries < ARP_RETRIES) {
+      e->retries++;
+      e->req_time = now;
+      arp_request(e->ip);
+      continue;
+    }
 
-    // Request it and wait
-    arp_request(ip);
-    wait(1000);
+    // Give up
+    debug_putstr("net: can't find hw address for %d.%d.%d.%d. Aborted\n",
+      e->ip[0], e->ip[1], e->ip[2], e->ip[3]);
+    for(uint i=0; i<ARP_QUEUE_LEN; i++) {
+      if(arp_queue[i].entry == e) {
+        arp_queue[i].entry = NULL;
+        arp_queued--;
+        stats.tx_unresolved++;
+      }
+    }
+    e->state = ARP_FREE;
+  }
+  enable_interrupts();
+}
+
+// Send IP packet
+// data must be preceded by IP_HEADROOM bytes
+static uint ip_send(uint8_t *dst_ip, uint8_t protocol, uint8_t *data, size_t len)
+{
+  const size_t head_len = sizeof(ip_hdr_t);
+  ip_hdr_t *ih = (ip_hdr_t*)(data - head_len);
+  static uint id = 0;
+  id++;
 
-    // Try again
-    mac = find_mac_in_table(ip);
-    i++;
+  // Last sent header. Consecutive packets to the same
+  // destination only change length and id
+  static ip_hdr_t last = {0};
+  const uint16_t ip_len = BSWAP_16(len+head_len);
+  const uint16_t ip_id = BSWAP_16(id);
+
+  if(last.ver_ihl != 0 && last.protocol == protocol &&
+    memcmp(last.src, local_ip, sizeof(last.src)) == 0 &&
+    memcmp(last.dst, dst_ip, sizeof(last.dst)) == 0) {
+    // Update checksum incrementally
+    last.checksum = net_checksum_update(last.checksum, last.len, ip_len);
+    last.checksum = net_checksum_update(last.checksum, last.id, ip_id);
+    last.len = ip_len;
+    last.id = ip_id;
+  } else {
+    last.ver_ihl = (4<<4) | 5;
+    last.tos = 0;
+    last.len = ip_len;
+    last.id = ip_id;
+    last.offset = BSWAP_16(0);
+    last.ttl = 128;
+    last.protocol = protocol;
+    last.checksum = 0;
+    memcpy(last.src, local_ip, sizeof(last.src));
+    memcpy(last.dst, dst_ip, sizeof(last.dst));
+    last.checksum = BSWAP_16(net_checksum((uint8_t*)&last, head_len));
   }
 
-  // Unsuccessful
-  if(mac == NULL) {
-    return ERROR_NOT_FOUND;
+  memcpy(ih, &last, head_len);
+  if(nic->flags & NIC_TX_CSUM) {
+    ih->checksum = 0; // Computed by the nic
   }
 
-  return NO_ERROR;
+  // Send to next hop
+  return arp_send_ip(get_effective_ip(dst_ip), (uint8_t*)ih, head_len+len);
 }
 
 // Send UDP packet
 static uint udp_send(uint8_t *dst_ip, uint16_t src_port, uint16_t dst_port,
   uint8_t *data, size_t len)
 {
-  typedef struct udpip_hdr_t {
-    uint8_t  sender[4];
-    uint8_t  recver[4];
-    uint8_t  zero;
-    uint8_t  protocol;
-    uint16_t len;
-  } udpip_hdr_t;
-
-  // Provide hw addresss before process
-  if(provide_mac_address(dst_ip) != NO_ERROR ||
-    provide_mac_address(local_gate) != NO_ERROR) {
-    debug_putstr("net: can't find hw address for %d.%d.%d.%d. Aborted\n",
-      dst_ip[0], dst_ip[1], dst_ip[2], dst_ip[3]);
-    return ERROR_NOT_FOUND;
-  }
-
   // Clamp len
   const size_t head_len = sizeof(udp_hdr_t);
-  const size_t iphead_len = sizeof(udpip_hdr_t);
-  len = min(sizeof(snd_buff) - iphead_len-head_len -
-    sizeof(ip_hdr_t) - sizeof(eth_hdr_t), len);
+  len = min(sizeof(snd_buff) - UDP_HEADROOM, len);
 
-  // Generate UDP packet and send
-  memset(snd_buff, 0, sizeof(snd_buff));
-  memcpy(&(snd_buff[iphead_len+head_len]), data, len);
+  // Generate UDP packet after the headroom and send.
+  // This is the only copy of the payload
+  memcpy(&snd_buff[UDP_HEADROOM], data, len);
 
-  udp_hdr_t *uh = (udp_hdr_t*)&snd_buff[iphead_len];
+  udp_hdr_t *uh = (udp_hdr_t*)&snd_buff[IP_HEADROOM];
   uh->src_port = BSWAP_16(src_port);
   uh->dst_port = BSWAP_16(dst_port);
   uh->len = BSWAP_16(len+head_len);
-
-  udpip_hdr_t *ih = (udpip_hdr_t*)snd_buff;
-  memcpy(ih->sender, local_ip, sizeof(ih->sender));
-  memcpy(ih->recver, dst_ip, sizeof(ih->recver));
-  ih->zero = 0;
-  ih->protocol = IP_PROTOCOL_UDP;
-  ih->len = uh->len;
-  uint checksum = net_checksum(snd_buff, iphead_len+len+head_len);
-  uh->checksum = BSWAP_16(checksum);
+  uh->checksum = 0;
+
+  // Checksum covers a pseudo header and the UDP packet
+  uint32_t sum = net_checksum_pseudo(local_ip, dst_ip,
+    IP_PROTOCOL_UDP, head_len+len);
+
+  // The nic expects the pseudo header sum, and adds the packet
+  if(nic->flags & NIC_TX_CSUM) {
+    uh->checksum = net_checksum_fold(sum);
+  } else {
+    sum = checksum_acc(sum, uh, head_len+len);
+    uh->checksum = BSWAP_16(net_checksum_final(sum));
+    if(uh->checksum == 0) {
+      uh->checksum = 0xFFFF; // 0 means no checksum
+    }
+  }
   return ip_send(dst_ip, IP_PROTOCOL_UDP, (uint8_t*)uh, head_len+len);
 }
 
-// Process received IP packet
-static void ip_recv_process(uint8_t *buff)
+// Process received IP packet of len bytes
+static void ip_recv_process(uint8_t *buff, size_t len)
 {
-  // Store only one packet
-  if(rcv_buff.size > 0) {
-    debug_putstr("net: packet received but discarded (buffer is full)\n");
-    return;
-  }
-
   // Check UDP packet type
   ip_hdr_t *ih = (ip_hdr_t*)buff;
-  if(ih->protocol == IP_PROTOCOL_UDP) {
+  if(len >= sizeof(ip_hdr_t) + sizeof(udp_hdr_t) &&
+    ih->protocol == IP_PROTOCOL_UDP) {
     size_t head_len = sizeof(ip_hdr_t);
     buff += head_len; // Advance buffer
     udp_hdr_t *uh = (udp_hdr_t*)buff;
     head_len = sizeof(udp_hdr_t);
 
+    // UDP length includes its header, and must be inside the frame
+    const size_t udp_len = BSWAP_16(uh->len);
+    if(udp_len < head_len || udp_len > len - sizeof(ip_hdr_t)) {
+      stats.rx_errors++;
+      return;
+    }
+
     debug_putstr("net: UDP received: %u.%u.%u.%u:%u to port %u (%u bytes)\n",
       ih->src[0], ih->src[1], ih->src[2], ih->src[3],
-      BSWAP_16(uh->src_port), BSWAP_16(uh->dst_port), BSWAP_16(uh->len)-head_len);
+      BSWAP_16(uh->src_port), BSWAP_16(uh->dst_port), udp_len-head_len);
+
+    // Queue it in the socket bound to its port
+    socket_t *s = find_socket(BSWAP_16(uh->dst_port));
+    if(s == NULL) {
+      stats.rx_unbound++;
+      return;
+    }
 
-    // Store it
-    if(BSWAP_16(uh->dst_port) == rcv_port)
-    {
-      rcv_buff.addr.port = BSWAP_16(uh->src_port);
-      rcv_buff.size = min(BSWAP_16(uh->len)-head_len, sizeof(rcv_buff.buff));
-      memcpy(rcv_buff.addr.ip, ih->src, sizeof(rcv_buff.addr.ip));
-      memcpy(rcv_buff.buff, &buff[head_len], rcv_buff.size);
-      debug_putstr("net: UDP packet was stored\n");
+    const uint next = (s->head + 1) % NET_RX_QUEUE_LEN;
+    if(next == s->tail) {
+      stats.rx_dropped++;
+      debug_putstr("net: packet received but discarded (queue is full)\n");
+      return;
     }
+
+    netpacket_t *p = &s->queue[s->head];
+    p->addr.port = BSWAP_16(uh->src_port);
+    p->size = min(udp_len-head_len, sizeof(p->buff));
+    memcpy(p->addr.ip, ih->src, sizeof(p->addr.ip));
+    memcpy(p->buff, &buff[head_len], p->size);
+    s->head = next;
+    stats.rx_queued++;
+    debug_putstr("net: UDP packet was queued\n");
   }
 }
 
-// Process received ARP packet
-static void arp_recv_process(uint8_t *buff)
+// Process received ARP packet of len bytes
+static void arp_recv_process(uint8_t *buff, size_t len)
 {
   arp_hdr_t *ah = (arp_hdr_t*)buff;
 
-  if(ah->hrd == BSWAP_16(ARP_HTYPE_ETHER) &&
+  if(len >= sizeof(arp_hdr_t) &&
+    ah->hrd == BSWAP_16(ARP_HTYPE_ETHER) &&
     ah->pro == BSWAP_16(ARP_PTYPE_IP)) {
-    // If it's a reply
-    if(ah->op == BSWAP_16(ARP_OP_REPLY) &&
-      memcmp(ah->dpa, local_ip, sizeof(ah->dpa)) == 0) {
-      // If exists in table, update entry
-      uint8_t *mac = find_mac_in_table(ah->spa);
-      if(mac) {
-        memcpy(mac, ah->sha, sizeof(ah->sha));
-        debug_putstr("net: ARP: updated: %d.%d.%d.%d : %2x:%2x:%2x:%2x:%2x:%2x\n",
-          ah->spa[0], ah->spa[1], ah->spa[2], ah->spa[3],
-          ah->sha[0], ah->sha[1], ah->sha[2], ah->sha[3], ah->sha[4], ah->sha[5]);
-      } else { // If does not exist, create new entry
-        for(uint i=0; i<ARP_TABLE_LEN; i++) {
-          if(arp_table[i].ip[0] == 0 || i==ARP_TABLE_LEN-1) { // Free entry
-            memcpy(arp_table[i].ip, ah->spa, sizeof(arp_table[i].ip));
-            memcpy(arp_table[i].mac, ah->sha, sizeof(arp_table[i].mac));
-            debug_putstr("net: ARP: added: %d.%d.%d.%d : %2x:%2x:%2x:%2x:%2x:%2x\n",
-              ah->spa[0], ah->spa[1], ah->spa[2], ah->spa[3],
-              ah->sha[0], ah->sha[1], ah->sha[2], ah->sha[3], ah->sha[4], ah->sha[5]);
-            break;
-          }
-        }
+    const bool for_us = (memcmp(ah->dpa, local_ip, sizeof(ah->dpa)) == 0);
+
+    // Another host claims the local IP: announce it again
+    if(memcmp(ah->spa, local_ip, sizeof(ah->spa)) == 0) {
+      if(memcmp(ah->sha, local_mac, sizeof(ah->sha)) != 0) {
+        debug_putstr("net: ARP: local IP address conflict\n");
+        arp_request(local_ip);
       }
+      return;
+    }
+
+    // Update sender address if known, including gratuitous
+    // ARP announcements. Add it if the packet is for us
+    arp_update(ah->spa, ah->sha, for_us);
+
     // Reply in case it's a local MAC address request
-    } else if(ah->op == BSWAP_16(ARP_OP_REQUEST)) {
-      if(memcmp(ah->dpa, local_ip, sizeof(ah->dpa)) == 0) {
-        arp_reply(ah->sha, ah->spa);
-        debug_putstr("net: sent arp reply\n");
-      }
+    if(ah->op == BSWAP_16(ARP_OP_REQUEST) && for_us) {
+      arp_reply(ah->sha, ah->spa);
+      debug_putstr("net: sent arp reply\n");
     }
   }
 }
 
+// Process received ethernet frame
+static void eth_recv_process(uint8_t *frame, size_t len)
+{
+  // Process packet if broadcast or unicast to local_mac
+  eth_hdr_t *eh = (eth_hdr_t*)frame;
+  if(len < sizeof(eth_hdr_t)) {
+    return;
+  }
+
+  if(!memcmp(eh->dst, local_mac, sizeof(eh->dst)) ||
+    !memcmp(eh->dst, broadcast_mac, sizeof(eh->dst)))
+  {
+    // Redirect packets to type handlers
+    switch(BSWAP_16(eh->type)) {
+    case ARP_PTYPE_IP:
+      ip_recv_process(eh->data, len - sizeof(eth_hdr_t));
+      break;
+    case ARP_PTYPE_ARP:
+      arp_recv_process(eh->data, len - sizeof(eth_hdr_t));
+      break;
+    };
+  }
+}
+
 // Receive network packet
 static void ne2k_receive()
 {
@@ -691,21 +1076,24 @@ static void ne2k_receive()
     outb(base + NE2K_RBCR1, 0);
     outb(base + NE2K_CR, 0x12); // Read and start
 
-    for(uint i=0; i<4; i++) {
-      ((uint8_t*)&info)[i] = inb(base + NE2K_DATA);
-    }
+    insw(base + NE2K_DATA, &info, sizeof(info)/2);
 
     // Get the data
     outb(base + NE2K_RSAR0, 4);
     outb(base + NE2K_RSAR1, rx_next);
 
-    outb(base + NE2K_RBCR0, (info.len & 0xFF));
-    outb(base + NE2K_RBCR1, ((info.len >> 8) & 0xFF));
+    // Transfers are word sized: count must be even
+    const size_t count = (info.len + 1) & ~1;
+    outb(base + NE2K_RBCR0, (count & 0xFF));
+    outb(base + NE2K_RBCR1, ((count >> 8) & 0xFF));
 
     outb(base + NE2K_CR, 0x12); // Read and start
 
-    for(uint i=0; i<info.len; i++) {
-      tmp_buff[min(i, sizeof(tmp_buff)-1)] = inb(base + NE2K_DATA);
+    // Read what fits in buffer, discard the rest
+    const size_t stored = min(count, sizeof(tmp_buff));
+    insw(base + NE2K_DATA, tmp_buff, stored/2);
+    for(size_t i=stored; i<count; i+=2) {
+      inw(base + NE2K_DATA);
     }
 
     // Wait for operation completed
@@ -717,11 +1105,8 @@ static void ne2k_receive()
     // Update reception pages
     if(info.next) {
       rx_next = info.next;
-      if(rx_next == 0x40) {
-        outb(base + NE2K_BNRY, 0x80);
-      } else {
-        outb(base + NE2K_BNRY, rx_next==0x46?0x7F:rx_next-1);
-      }
+      outb(base + NE2K_BNRY,
+        rx_next==NE2K_RX_START ? NE2K_RX_STOP-1 : rx_next-1);
     }
 
     // Update current and bndry values
@@ -735,25 +1120,7 @@ static void ne2k_receive()
     }
     outb(base + NE2K_ISR, NE2K_STAT_RDC);
 
-    // Process packet if broadcast or unicast to local_mac
-    eth_hdr_t *eh = (eth_hdr_t*)tmp_buff;
-
-    if(!memcmp(eh->dst, local_mac, sizeof(eh->dst)) ||
-      !memcmp(eh->dst, arp_table[0].mac, sizeof(eh->dst)))
-    {
-      // Clamp length to reception buffer size
-      info.len = min(sizeof(tmp_buff), info.len);
-
-      // Redirect packets to type handlers
-      switch(BSWAP_16(eh->type)) {
-      case ARP_PTYPE_IP:
-        ip_recv_process(eh->data);
-        break;
-      case ARP_PTYPE_ARP:
-        arp_recv_process(eh->data);
-        break;
-      };
-    }
+    eth_recv_process(tmp_buff, min(sizeof(tmp_buff), info.len));
 
     // Break if no more packets
     if(info.next == current || !info.next) {
@@ -763,81 +1130,42 @@ static void ne2k_receive()
 }
 
 // ne2k interrupt handler
-void net_handler()
+static void ne2k_handler()
 {
-  // Network must be enabled
-  if(network_state == NET_STATE_ENABLED) {
-    uint8_t isr = 0;
-
-    // Iterate because more interrupts
-    // can be received while handling previous
-    while((isr = inb(base + NE2K_ISR)) != 0) {
-      if(isr & NE2K_STAT_RX) {
-        ne2k_receive();
-      }
-      if(isr & NE2K_STAT_TX) {
-      }
-
-      // Clear interrupt bits
-      outb(base + NE2K_ISR, isr);
+  uint8_t isr = 0;
+
+  // Iterate because more interrupts
+  // can be received while handling previous.
+  // Clear interrupt bits before handling, so events raised
+  // meanwhile (like the end of a transmission started by
+  // ne2k_transmit_done) are not lost
+  while((isr = inb(base + NE2K_ISR)) != 0) {
+    outb(base + NE2K_ISR, isr);
+
+    if(isr & NE2K_STAT_RX) {
+      ne2k_receive();
     }
-  }
-
-  lapic_eoi();
-  return;
-}
-
-// Initialize network
-void io_net_init()
-{
-  // Reset translation table
-  memset(arp_table, 0, sizeof(arp_table));
-
-  // Reset received data
-  memset(&rcv_buff.addr, 0, sizeof(rcv_buff.addr));
-  rcv_buff.size = 0;
-
-  // Detect card
-  network_state = NET_STATE_DISABLED;
-  uint net_irq = 0x0B; // network irq
-  {
-    PCI_device_t *pdev = NULL;
-
-    // Find a compatible device
-    for(uint i=0; i<NUM_COMPATIBLE_DEVICES; i++) {
-      pdev = pci_find_device(ne2k_compatible[i].vendor_id,
-        ne2k_compatible[i].device_id);
-
-      if(pdev) {
-        break;
-      }
+    if(isr & (NE2K_STAT_TX|NE2K_STAT_TXE)) {
+      ne2k_transmit_done();
     }
-
-    // If found, check
-    if(pdev) {
-      base = pdev->bar0 & ~3;
-      net_irq = pdev->interrput_line;
-      outb(base + NE2K_IMR, 0x80); // Disable interrupts except reset
-      outb(base + NE2K_ISR, 0xFF); // Clear interrupts
-      outb(base + NE2K_RESET, inb(base + NE2K_RESET)); // Reset
-      wait(250); // Wait
-      if((inb(base + NE2K_ISR) == NE2K_STAT_RST)) { // Detect reset
-        debug_putstr("net: ne2000 compatible nic found. base=%x irq=%d\n",
-        base, net_irq);
-        network_state = NET_STATE_ENABLED;
-      }
+    if(isr & NE2K_STAT_OVW) {
+      stats.rx_overruns++;
     }
   }
+}
 
-  // Abort if network is not enabled or device not found
-  if(network_state != NET_STATE_ENABLED) {
-    debug_putstr("net: compatible nic not found\n");
-    return;
+// Initialize ne2k nic
+static bool ne2k_init(PCI_device_t *pdev)
+{
+  base = pdev->bar0 & ~3;
+  outb(base + NE2K_IMR, 0x80); // Disable interrupts except reset
+  outb(base + NE2K_ISR, 0xFF); // Clear interrupts
+  outb(base + NE2K_RESET, inb(base + NE2K_RESET)); // Reset
+  wait(250); // Wait
+  if((inb(base + NE2K_ISR) != NE2K_STAT_RST)) { // Detect reset
+    return FALSE;
   }
 
-  // Install IRQ handler
-  set_network_IRQ(net_irq);
-
   // Reset, and wait
   outb(base + NE2K_RESET, inb(base + NE2K_RESET));
   while((inb(base + NE2K_ISR) & NE2K_STAT_RST) == 0) {
@@ -847,16 +1175,20 @@ void io_net_init()
 
   ne2k_page_select(0);
   outb(base + NE2K_CR, 0x21);  // Stop DMA and MAC
-  outb(base + NE2K_DCR, 0x48); // Access by bytes
+  outb(base + NE2K_DCR, 0x49); // Access by words
   outb(base + NE2K_TCR, 0xE0); // Transmit: normal operation, aut-append and check CRC
   outb(base + NE2K_RCR, 0xDE); // Receive: Accept and buffer
   outb(base + NE2K_IMR, 0x00); // Disable interrupts
   outb(base + NE2K_ISR, 0xFF); // NE2K_ISR must be cleared
 
-  outb(base + NE2K_TPSR, 0x40 );       // Transmit page start
-  outb(base + NE2K_PSTART, rx_next-1); // Receive page start
-  outb(base + NE2K_PSTOP, 0x80);       // Receive page stop
-  outb(base + NE2K_BNRY, rx_next-1);   // Boundary
+  rx_next = NE2K_RX_START + 1;
+  tx_len[0] = tx_len[1] = 0;
+  tx_load = 0;
+  tx_busy = FALSE;
+  outb(base + NE2K_TPSR, NE2K_TX_START);   // Transmit page start
+  outb(base + NE2K_PSTART, NE2K_RX_START); // Receive page start
+  outb(base + NE2K_PSTOP, NE2K_RX_STOP);   // Receive page stop
+  outb(base + NE2K_BNRY, rx_next-1);       // Boundary
   ne2k_page_select(1);
   outb(base + NE2K_CURR, rx_next);     // Change current recv page
 
@@ -866,14 +1198,10 @@ void io_net_init()
   outb(base + NE2K_RBCR0, 24);         // 24 bytes count
   outb(base + NE2K_RBCR1, 0x00);
   outb(base + NE2K_CR, 0x0A);
-  // Print MAC
-  debug_putstr("net: MAC: ");
-  for(uint i=0; i<6; i++) {
-    local_mac[i] = inb(base + NE2K_DATA);
-    inb(base + NE2K_DATA); // Word sized, read again to advance
-    debug_putstr("%2x ", local_mac[i]);
+  // Read MAC
+  for(uint i=0; i<MAC_LEN; i++) {
+    local_mac[i] = inw(base + NE2K_DATA) & 0xFF; // PROM bytes are doubled
   }
-  debug_putstr("\n");
 
   // Listen to this MAC
   ne2k_page_select(1);
@@ -892,51 +1220,490 @@ void io_net_init()
   ne2k_page_select(0);
   outb(base + NE2K_CR, 0x22); // Start and no DMA
   // Set interrupt mask to read/write
-  outb(base + NE2K_IMR, NE2K_IMR_PRXE|NE2K_IMR_PTXE);
+  outb(base + NE2K_IMR,
+    NE2K_IMR_PRXE|NE2K_IMR_PTXE|NE2K_IMR_TXEE|NE2K_IMR_OVWE);
+
+  return TRUE;
+}
+
+// Send network packet (hardware, rtl8139)
+// The frame is copied to the next transmit descriptor buffer,
+// and the nic fetches it from there
+static uint rtl8139_send(uint8_t *data, size_t len)
+{
+  const uint d = rtl_tx_next;
+  rtl_tx_next = (rtl_tx_next + 1) % RTL_TX_DESCS;
+
+  // Wait until the nic has fetched the previous frame
+  // of this descriptor. OWN is also set after reset
+  while((ind(base + RTL_TSD0 + 4*d) & RTL_TSD_OWN) == 0) {
+  }
+
+  memcpy((uint8_t*)RTL_TX_ADDRESS + d*RTL_TX_BUFF_LEN, data,
+    min(len, RTL_TX_BUFF_LEN));
+  outd(base + RTL_TSD0 + 4*d, min(len, RTL_TX_BUFF_LEN)); // Clear OWN: send
+
+  return NO_ERROR;
+}
+
+// Receive network packets (hardware, rtl8139)
+// Frames are processed where the nic stored them
+static void rtl8139_receive()
+{
+  uint8_t *ring = (uint8_t*)RTL_RX_ADDRESS;
+
+  while((inb(base + RTL_CR) & RTL_CR_BUFE) == 0) {
+    // Each packet has a header: status and length (with CRC)
+    const uint16_t status = *(uint16_t*)&ring[rtl_rx_offset];
+    const uint16_t len = *(uint16_t*)&ring[rtl_rx_offset + 2];
+
+    if((status & RTL_RX_ROK) == 0 ||
+      len < sizeof(eth_hdr_t) + ETH_CRC_LEN || len > sizeof(tmp_buff)) {
+      // Bad packet: restart reception
+      debug_putstr("net: rtl8139: bad packet (status %x)\n", status);
+      stats.rx_errors++;
+      outb(base + RTL_CR, RTL_CR_TE);
+      outb(base + RTL_CR, RTL_CR_RE|RTL_CR_TE);
+      outd(base + RTL_RCR, RTL_RCR_CONFIG);
+      rtl_rx_offset = 0;
+      return;
+    }
+
+    eth_recv_process(&ring[rtl_rx_offset + 4], len - ETH_CRC_LEN);
+
+    // Next packet is dword aligned
+    rtl_rx_offset = ((rtl_rx_offset + 4 + len + 3) & ~3) % RTL_RX_RING_LEN;
+    outw(base + RTL_CAPR, rtl_rx_offset - 16);
+  }
+}
+
+// rtl8139 interrupt handler
+static void rtl8139_handler()
+{
+  uint16_t isr = 0;
+
+  // Clear interrupt bits before handling,
+  // so no new event is lost
+  while((isr = inw(base + RTL_ISR)) != 0) {
+    outw(base + RTL_ISR, isr);
+
+    if(isr & (RTL_INT_ROK|RTL_INT_RER)) {
+      rtl8139_receive();
+    }
+    if(isr & (RTL_INT_RXOVW|RTL_INT_FOVW)) {
+      stats.rx_overruns++;
+    }
+  }
+}
+
+// Initialize rtl8139 nic
+static bool rtl8139_init(PCI_device_t *pdev)
+{
+  base = pdev->bar0 & ~3;
+  pci_enable_bus_master(pdev);
+
+  outb(base + RTL_CONFIG1, 0x00); // Power on
+  outb(base + RTL_CR, RTL_CR_RST); // Reset, and wait
+  while(inb(base + RTL_CR) & RTL_CR_RST) {
+  }
+
+  debug_putstr("net: nic reset\n");
+
+  // Read MAC
+  for(uint i=0; i<MAC_LEN; i++) {
+    local_mac[i] = inb(base + RTL_IDR0 + i);
+  }
+
+  // Set buffers. Memory is identity mapped
+  rtl_rx_offset = 0;
+  rtl_tx_next = 0;
+  outd(base + RTL_RBSTART, RTL_RX_ADDRESS);
+  for(uint d=0; d<RTL_TX_DESCS; d++) {
+    outd(base + RTL_TSAD0 + 4*d, RTL_TX_ADDRESS + d*RTL_TX_BUFF_LEN);
+  }
+
+  outb(base + RTL_CR, RTL_CR_RE|RTL_CR_TE);
+  outd(base + RTL_RCR, RTL_RCR_CONFIG);
+  outd(base + RTL_TCR, RTL_TCR_CONFIG);
+  outw(base + RTL_ISR, 0xFFFF); // Clear interrupts
+  outw(base + RTL_IMR, RTL_INT_ROK|RTL_INT_RER|RTL_INT_RXOVW|RTL_INT_FOVW);
+
+  return TRUE;
+}
+
+// Read e1000 register
+static uint32_t e1000_read(uint reg)
+{
+  return *(volatile uint32_t*)(base + reg);
+}
+
+// Write e1000 register
+static void e1000_write(uint reg, uint32_t value)
+{
+  *(volatile uint32_t*)(base + reg) = value;
+}
+
+// Send network packet (hardware, e1000)
+// The frame is copied to the buffer of the next transmit descriptor.
+// IP and UDP checksums are computed by the nic
+static uint e1000_send(uint8_t *data, size_t len)
+{
+  const uint d = e1000_tx_next;
+  e1000_tx_next = (e1000_tx_next + 1) % E1000_TX_DESCS;
 
-  // Add broadcast address to translation table
-  memset(arp_table[0].mac, 0xFF, sizeof(arp_table[0].mac));
-  memset(arp_table[0].ip, 0xFF, sizeof(arp_table[0].ip));
+  // Keep a descriptor free, so the ring is never seen as empty
+  // when it's full. Processed descriptors have DD status
+  while((e1000_tx_desc[e1000_tx_next].status & E1000_DESC_DD) == 0) {
+  }
+
+  // Offload checksums of UDP/IP packets
+  uint8_t popts = 0;
+  const eth_hdr_t *eh = (eth_hdr_t*)data;
+  if(eh->type == BSWAP_16(ETH_TYPE_IP)) {
+    popts |= E1000_POPTS_IXSM;
+    if(((ip_hdr_t*)eh->data)->protocol == IP_PROTOCOL_UDP) {
+      popts |= E1000_POPTS_TXSM;
+    }
+  }
+
+  len = min(len, E1000_BUFF_LEN);
+  uint8_t *buff = (uint8_t*)E1000_TX_BUFF_ADDRESS + d*E1000_BUFF_LEN;
+  memcpy(buff, data, len);
+
+  e1000_data_desc_t *desc = &e1000_tx_desc[d];
+  desc->addr_lo = (uint32_t)buff;
+  desc->addr_hi = 0;
+  desc->cmd_len = len | E1000_DTYP_DATA |
+    E1000_DCMD_EOP | E1000_DCMD_IFCS | E1000_DCMD_RS | E1000_DCMD_DEXT;
+  desc->status = 0;
+  desc->popts = popts;
+  desc->special = 0;
+  e1000_write(E1000_TDT, e1000_tx_next);
+
+  return NO_ERROR;
+}
+
+// Receive network packets (hardware, e1000)
+// Frames are processed where the nic stored them
+static void e1000_receive()
+{
+  e1000_rx_desc_t *desc = &e1000_rx_desc[e1000_rx_next];
+
+  while(desc->status & E1000_DESC_DD) {
+    // Discard frames with errors or bad checksums.
+    // Frames bigger than a buffer are not expected
+    if(desc->errors == 0 && (desc->status & E1000_DESC_EOP)) {
+      eth_recv_process((uint8_t*)desc->addr_lo, desc->length);
+    } else {
+      stats.rx_errors++;
+    }
+
+    // Return descriptor to the nic
+    desc->status = 0;
+    e1000_write(E1000_RDT, e1000_rx_next);
+    e1000_rx_next = (e1000_rx_next + 1) % E1000_RX_DESCS;
+    desc = &e1000_rx_desc[e1000_rx_next];
+  }
 }
 
+// e1000 interrupt handler
+static void e1000_handler()
+{
+  uint32_t icr = 0;
+
+  // Reading ICR clears it
+  while((icr = e1000_read(E1000_ICR)) != 0) {
+    if(icr & (E1000_INT_RXT0|E1000_INT_RXDMT0|E1000_INT_RXO)) {
+      e1000_receive();
+    }
+    if(icr & E1000_INT_RXO) {
+      stats.rx_overruns++;
+    }
+  }
+}
+
+// Initialize e1000 nic
+static bool e1000_init(PCI_device_t *pdev)
+{
+  base = pdev->bar0 & ~0xF; // Memory mapped registers
+  pci_enable_bus_master(pdev);
+
+  // Reset, and wait
+  e1000_write(E1000_IMC, 0xFFFFFFFF);
+  e1000_write(E1000_CTRL, e1000_read(E1000_CTRL) | E1000_CTRL_RST);
+  wait(1);
+  while(e1000_read(E1000_CTRL) & E1000_CTRL_RST) {
+  }
+  e1000_write(E1000_IMC, 0xFFFFFFFF);
+  e1000_read(E1000_ICR);
+
+  debug_putstr("net: nic reset\n");
+
+  e1000_write(E1000_CTRL, e1000_read(E1000_CTRL) | E1000_CTRL_SLU);
+
+  // Read MAC, loaded from the EEPROM after reset
+  const uint32_t ral = e1000_read(E1000_RAL0);
+  const uint32_t rah = e1000_read(E1000_RAH0);
+  for(uint i=0; i<4; i++) {
+    local_mac[i] = (ral >> (8*i)) & 0xFF;
+  }
+  local_mac[4] = rah & 0xFF;
+  local_mac[5] = (rah >> 8) & 0xFF;
+  e1000_write(E1000_RAH0, rah | E1000_RAH_AV);
+
+  // Clear multicast
+  for(uint i=0; i<E1000_MTA_LEN; i++) {
+    e1000_write(E1000_MTA + 4*i, 0);
+  }
+
+  // Reception ring. Memory is identity mapped
+  memset(e1000_rx_desc, 0, E1000_RX_DESCS*sizeof(e1000_rx_desc_t));
+  for(uint d=0; d<E1000_RX_DESCS; d++) {
+    e1000_rx_desc[d].addr_lo = E1000_RX_BUFF_ADDRESS + d*E1000_BUFF_LEN;
+  }
+  e1000_rx_next = 0;
+  e1000_write(E1000_RDBAL, (uint32_t)e1000_rx_desc);
+  e1000_write(E1000_RDBAH, 0);
+  e1000_write(E1000_RDLEN, E1000_RX_DESCS*sizeof(e1000_rx_desc_t));
+  e1000_write(E1000_RDH, 0);
+  e1000_write(E1000_RDT, E1000_RX_DESCS-1);
+  e1000_write(E1000_RXCSUM, E1000_RXCSUM_IPOFLD|E1000_RXCSUM_TUOFLD);
+  e1000_write(E1000_RCTL, E1000_RCTL_EN|E1000_RCTL_BAM|E1000_RCTL_SECRC);
+
+  // Transmission ring. All descriptors are free but the first one,
+  // which sets the checksum offload context of UDP/IP packets
+  memset(e1000_tx_desc, 0, E1000_TX_DESCS*sizeof(e1000_data_desc_t));
+  for(uint d=1; d<E1000_TX_DESCS; d++) {
+    e1000_tx_desc[d].status = E1000_DESC_DD;
+  }
+  e1000_context_desc_t *ctx = (e1000_context_desc_t*)&e1000_tx_desc[0];
+  ctx->ipcss = sizeof(eth_hdr_t);
+  ctx->ipcso = sizeof(eth_hdr_t) + 10; // ip_hdr_t checksum
+  ctx->ipcse = sizeof(eth_hdr_t) + sizeof(ip_hdr_t) - 1;
+  ctx->tucss = sizeof(eth_hdr_t) + sizeof(ip_hdr_t);
+  ctx->tucso = sizeof(eth_hdr_t) + sizeof(ip_hdr_t) + 6; // udp_hdr_t checksum
+  ctx->tucse = 0; // Until the end of the packet
+  ctx->cmd_len = E1000_DTYP_CONTEXT |
+    E1000_TUCMD_IP | E1000_DCMD_RS | E1000_DCMD_DEXT;
+  e1000_tx_next = 1;
+  e1000_write(E1000_TDBAL, (uint32_t)e1000_tx_desc);
+  e1000_write(E1000_TDBAH, 0);
+  e1000_write(E1000_TDLEN, E1000_TX_DESCS*sizeof(e1000_data_desc_t));
+  e1000_write(E1000_TDH, 0);
+  e1000_write(E1000_TDT, e1000_tx_next);
+  e1000_write(E1000_TIPG, E1000_TIPG_CONFIG);
+  e1000_write(E1000_TCTL, E1000_TCTL_CONFIG);
+
+  // Interrupt moderation and mask
+  e1000_write(E1000_ITR, E1000_ITR_INTERVAL);
+  e1000_write(E1000_IMS, E1000_INT_RXT0|E1000_INT_RXDMT0|E1000_INT_RXO);
+
+  return TRUE;
+}
+
+// Supported nics
+#define NUM_SUPPORTED_NICS 3
+static const nic_t supported_nic[NUM_SUPPORTED_NICS] = {
+  {"ne2000",  0x10EC, 0x8029, 0,           ne2k_init,    ne2k_send,    ne2k_handler},
+  {"rtl8139", 0x10EC, 0x8139, 0,           rtl8139_init, rtl8139_send, rtl8139_handler},
+  {"e1000",   0x8086, 0x100E, NIC_TX_CSUM, e1000_init,   e1000_send,   e1000_handler},
+};
+
+// Network interrupt handler
+void net_handler()
+{
+  // Network must be enabled
+  // IRQ gates keep interrupts enabled, but the nic and ARP
+  // state can't be used by the timer handler meanwhile
+  disable_interrupts();
+  if(network_state == NET_STATE_ENABLED) {
+    nic->handler();
+  }
+
+  lapic_eoi();
+  enable_interrupts();
+  return;
+}
+
+// Initialize network
+void io_net_init()
+{
+  // Reset translation table and pending packets
+  memset(arp_table, 0, sizeof(arp_table));
+  memset(arp_queue, 0, ARP_QUEUE_LEN*sizeof(arp_pending_t));
+  arp_queued = 0;
+
+  // Reset sockets and bind default port
+  memset(socket, 0, sizeof(socket));
+  for(uint i=0; i<NET_MAX_SOCKETS; i++) {
+    socket[i].queue = (netpacket_t*)NET_RX_QUEUE_ADDRESS + i*NET_RX_QUEUE_LEN;
+  }
+  rcv_port = UDP_SEND_PORT;
+  io_net_bind(rcv_port, FALSE);
+  memset(&stats, 0, sizeof(stats));
+
+  // Detect card
+  network_state = NET_STATE_DISABLED;
+  uint net_irq = 0x0B; // network irq
+  for(uint i=0; i<NUM_SUPPORTED_NICS; i++) {
+    PCI_device_t *pdev = pci_find_device(supported_nic[i].vendor_id,
+      supported_nic[i].device_id);
+
+    // If found, initialize
+    if(pdev && supported_nic[i].init(pdev)) {
+      nic = &supported_nic[i];
+      net_irq = pdev->interrput_line;
+      debug_putstr("net: %s compatible nic found. base=%x irq=%d\n",
+        nic->name, base, net_irq);
+      network_state = NET_STATE_ENABLED;
+      break;
+    }
+  }
+
+  // Abort if network is not enabled or device not found
+  if(network_state != NET_STATE_ENABLED) {
+    debug_putstr("net: compatible nic not found\n");
+    return;
+  }
+
+  // Print MAC
+  debug_putstr("net: MAC: ");
+  for(uint i=0; i<MAC_LEN; i++) {
+    debug_putstr("%2x ", local_mac[i]);
+  }
+  debug_putstr("\n");
+
+  // Install IRQ handler
+  set_network_IRQ(net_irq);
+
+  // Announce local address
+  disable_interrupts();
+  arp_request(local_ip);
+  enable_interrupts();
+}
 // Send buffer to dst
-uint io_net_send(net_address_t *dst, uint8_t *buff, size_t len)
+uint io_net_send(uint16_t src_port, net_address_t *dst,
+  uint8_t *buff, size_t len)
 {
   if(network_state == NET_STATE_ENABLED) {
-    return udp_send(dst->ip, UDP_SEND_PORT, dst->port,
-      buff, len);
+    // The nic is also used by interrupt handlers
+    disable_interrupts();
+    uint32_t start = 0, end = 0, hi = 0;
+    rdtsc(&start, &hi);
+    const uint result = udp_send(dst->ip,
+      src_port ? src_port : UDP_SEND_PORT, dst->port, buff, len);
+    rdtsc(&end, &hi);
+
+    // Smoothed average of the send path cost
+    const uint cycles = end - start;
+    stats.tx_packets++;
+    stats.tx_cycles = (stats.tx_packets == 1) ? cycles :
+      stats.tx_cycles - stats.tx_cycles/16 + cycles/16;
+    enable_interrupts();
+    return result;
   }
   return ERROR_NOT_AVAILABLE;
 }
 
 // Receive data
-uint io_net_recv(net_address_t *src, uint8_t *buff, size_t buff_size)
+uint io_net_recv(uint16_t port, net_address_t *src,
+  uint8_t *buff, size_t buff_size)
 {
   if(network_state == NET_STATE_ENABLED) {
-    // Now check if there is something in the system buffer
-    if(rcv_buff.size > 0) {
-      uint ret = min(rcv_buff.size, buff_size);
-      memcpy(src, &rcv_buff.addr, sizeof(rcv_buff.addr));
-      memcpy(buff, rcv_buff.buff, ret);
-      rcv_buff.size = 0;
+    // Now check if there is something in the reception queue
+    socket_t *s = find_socket(port ? port : rcv_port);
+    if(s != NULL && s->tail != s->head) {
+      const netpacket_t *p = &s->queue[s->tail];
+      uint ret = min(p->size, buff_size);
+      memcpy(src, &p->addr, sizeof(p->addr));
+      memcpy(buff, p->buff, ret);
+      s->tail = (s->tail + 1) % NET_RX_QUEUE_LEN;
       return ret;
     }
   }
   return 0;
 }
 
+// Bind a port to a free socket
+uint io_net_bind(uint16_t port, bool user)
+{
+  if(port == 0) {
+    return ERROR_NOT_AVAILABLE;
+  }
+  if(find_socket(port) != NULL) {
+    return ERROR_EXISTS;
+  }
+
+  for(uint i=0; i<NET_MAX_SOCKETS; i++) {
+    if(socket[i].port == 0) {
+      disable_interrupts();
+      socket[i].head = 0;
+      socket[i].tail = 0;
+      socket[i].port = port;
+      socket[i].user = user;
+      enable_interrupts();
+      return NO_ERROR;
+    }
+  }
+  return ERROR_NO_SPACE;
+}
+
+// Unbind a port. Its pending packets are discarded
+uint io_net_unbind(uint16_t port, bool user)
+{
+  socket_t *s = find_socket(port);
+  if(s == NULL || (user && !s->user)) {
+    return ERROR_NOT_FOUND;
+  }
+
+  disable_interrupts();
+  s->port = 0;
+  enable_interrupts();
+  return NO_ERROR;
+}
+
 // Get network state
 uint io_net_get_state()
 {
   return network_state;
 }
 
+// Unbind all ports bound by user programs
+void io_net_unbind_user_ports()
+{
+  disable_interrupts();
+  for(uint i=0; i<NET_MAX_SOCKETS; i++) {
+    if(socket[i].user) {
+      socket[i].port = 0;
+      socket[i].user = FALSE;
+    }
+  }
+  enable_interrupts();
+}
+
 // Set reception port
-void io_net_recv_set_port(uint16_t port)
+uint io_net_recv_set_port(uint16_t port)
 {
   if(port != rcv_port) {
-    // Clear buffer if port is different
-    rcv_buff.size = 0;
+    // A port bound with io_net_bind is not taken over
+    if(find_socket(port) != NULL) {
+      return ERROR_EXISTS;
+    }
+
+    // Pending data of the previous port is discarded
+    io_net_unbind(rcv_port, FALSE);
+    const uint result = io_net_bind(port, FALSE);
+    if(result != NO_ERROR) {
+      io_net_bind(rcv_port, FALSE);
+      return result;
+    }
     rcv_port = port;
   }
+  return NO_ERROR;
+}
+
+// Get network statistics
+void io_net_get_stats(net_stats_t *s)
+{
+  memcpy(s, &stats, sizeof(stats));
 }
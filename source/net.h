@@ -9,18 +9,39 @@ extern uint8_t local_gate[IP_LEN];
 // Initialize network
 void io_net_init();
 
-// Send buffer to dst. Return NO_ERROR on success
-uint io_net_send(net_address_t *dst, uint8_t *buff, size_t len);
+// Send buffer to dst from src_port, or from the
+// default port if src_port is 0. Return NO_ERROR on success
+uint io_net_send(uint16_t src_port, net_address_t *dst,
+  uint8_t *buff, size_t len);
 
-// Enable reception in this port and disable all others
-// Must be called once before start calling net_recv
-void io_net_recv_set_port(uint16_t port);
+// Sockets: up to NET_MAX_SOCKETS UDP ports can receive at the
+// same time. Each one has its own reception queue
+#define NET_MAX_SOCKETS 4
 
-// Get and remove from buffer received data.
-// src and buff are filled by the function
-// Call net_recv_set_port once before calling to this
-// function to enable a reception port
-uint io_net_recv(net_address_t *src, uint8_t *buff, size_t buff_size);
+// Bind a port so its packets are queued.
+// Ports bound by user programs are unbound when they exit
+// Return NO_ERROR on success
+uint io_net_bind(uint16_t port, bool user);
+
+// Unbind a port, discarding its pending packets.
+// User programs can only unbind ports bound by user programs
+// Return NO_ERROR on success
+uint io_net_unbind(uint16_t port, bool user);
+
+// Unbind all ports bound by user programs
+void io_net_unbind_user_ports();
+
+// Set the default reception port: unbind the previous
+// default port and bind this one
+// Return NO_ERROR on success
+uint io_net_recv_set_port(uint16_t port);
+
+// Get and remove from the queue of a bound port received data,
+// or from the default port queue if port is 0.
+// src and buff are filled by the function.
+// Returns number of bytes of buff that have been filled
+uint io_net_recv(uint16_t port, net_address_t *src,
+  uint8_t *buff, size_t buff_size);
 
 enum NET_STATE
 {
@@ -33,4 +54,23 @@ enum NET_STATE
 // See NET_STATE enum for returned values
 uint io_net_get_state();
 
+// Network statistics
+typedef struct net_stats_t {
+  uint rx_queued;   // Packets stored in the reception queue
+  uint rx_dropped;  // Packets dropped because a reception queue was full
+  uint rx_unbound;  // Packets dropped because their port was not bound
+  uint rx_overruns; // Nic reception ring overflows
+  uint rx_errors;   // Packets dropped because of reception errors
+  uint tx_arp_queued;  // Packets queued waiting for ARP resolution
+  uint tx_unresolved;  // Packets dropped: ARP unresolved or queue full
+  uint tx_packets;     // Packets sent with io_net_send
+  uint tx_cycles;      // Average processor cycles per io_net_send
+} net_stats_t;
+
+void io_net_get_stats(net_stats_t *stats);
+
+// Retry pending ARP requests and discard expired packets
+// Called periodically by the timer interrupt handler
+void io_net_timer();
+
 #endif // _NET_H
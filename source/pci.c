@@ -11,6 +11,9 @@
 #define MAX_PCI_DEVICE 16
 static uint pci_count = 0;
 static PCI_device_t pci_devices[MAX_PCI_DEVICE];
+static uint32_t pci_address[MAX_PCI_DEVICE]; // Config address of devices
+
+#define PCI_COMMAND_BUS_MASTER 0x0004
 
 // Read config
 static uint32_t pci_read_config(uint32_t pci_dev, uint8_t offset)
@@ -20,6 +23,14 @@ static uint32_t pci_read_config(uint32_t pci_dev, uint8_t offset)
   return ind(PCI_CONFIG_DATA_PORT);
 }
 
+// Write config
+static void pci_write_config(uint32_t pci_dev, uint8_t offset, uint32_t value)
+{
+  const uint32_t data = 0x80000000 | pci_dev | (offset & 0xFC);
+  outd(PCI_CONFIG_ADDR_PORT, data);
+  outd(PCI_CONFIG_DATA_PORT, value);
+}
+
 // Scan devices in bus 0
 void pci_init()
 {
@@ -47,6 +58,7 @@ void pci_init()
       for(uint i=0; i<sizeof(PCI_device_t); i+=4) {
         *p++ = pci_read_config(pci_dev_addr, i);
       }
+      pci_address[pci_count] = pci_dev_addr;
 
       pci_count++;
       if(pci_count >= MAX_PCI_DEVICE) {
@@ -76,3 +88,15 @@ PCI_device_t *pci_find_device(uint16_t vendor, uint16_t device)
   }
   return NULL;
 }
+
+// Allow device to initiate DMA transfers
+void pci_enable_bus_master(PCI_device_t *dev)
+{
+  const uint i = dev - pci_devices;
+  if(i < pci_count) {
+    // Status register is in the upper half. Its bits are cleared
+    // when written with 1, so write them as 0
+    dev->command |= PCI_COMMAND_BUS_MASTER;
+    pci_write_config(pci_address[i], 0x04, dev->command);
+  }
+}
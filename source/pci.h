@@ -41,5 +41,9 @@ void pci_init();
 // Find device
 PCI_device_t *pci_find_device(uint16_t vendor, uint16_t device);
 
+// Enable bus mastering
+// Allows the device to initiate DMA transfers
+void pci_enable_bus_master(PCI_device_t *dev);
+
 
 #endif // _PCI_H
@@ -18,21 +18,40 @@
 #define SCREEN_WIDTH  80
 #define SCREEN_HEIGHT 28
 
-// This buffer holds a copy of screen chars
-// Screen is only updated when it's actually needed
-static char *screen_buff = NULL;
-
-// Check the local screen buffer before actually updating
-// the screen
-static void editor_putchar(uint col, uint row, char c)
+// This buffer holds the screen cells. Changes are drawn
+// with a single putrect call, and only the changed rows
+static uint16_t *screen_buff = NULL;
+static uint dirty_first = SCREEN_HEIGHT; // First changed row
+static uint dirty_last = 0;              // Last changed row
+
+// Put a char in the screen buffer
+static void screen_putchar(uint col, uint row, char c, uint8_t attr)
 {
-  const uint screen_offset = col + (row-1)*SCREEN_WIDTH;
-  const char buff_c = *(screen_buff + screen_offset);
+  const uint screen_offset = col + row*SCREEN_WIDTH;
+  const uint16_t cell = SCREEN_CELL(c, attr);
+
+  if(screen_buff[screen_offset] != cell) {
+    screen_buff[screen_offset] = cell;
+    dirty_first = min(dirty_first, row);
+    dirty_last = max(dirty_last, row);
+  }
+}
 
-  if(c != buff_c) {
-    *(screen_buff + screen_offset) = c;
-    putc_attr(col, row, c, EDITOR_ATTRIBUTES);
+// Draw changed rows of the screen buffer
+static void screen_update()
+{
+  if(dirty_first <= dirty_last) {
+    putrect(0, dirty_first, SCREEN_WIDTH, dirty_last-dirty_first+1,
+      screen_buff + dirty_first*SCREEN_WIDTH);
   }
+  dirty_first = SCREEN_HEIGHT;
+  dirty_last = 0;
+}
+
+// Put a char in the editor area
+static void editor_putchar(uint col, uint row, char c)
+{
+  screen_putchar(col, row, c, EDITOR_ATTRIBUTES);
 }
 
 // Given a string (line input parameter)
@@ -228,7 +247,7 @@ int main(int argc, char *argv[])
   }
 
   // Allocate screen buffer
-  screen_buff = malloc((SCREEN_WIDTH*(SCREEN_HEIGHT-1)));
+  screen_buff = malloc(SCREEN_WIDTH*SCREEN_HEIGHT*sizeof(uint16_t));
   if(screen_buff == 0) {
     putstr("Error: can't allocate memory\n");
     mfree(buff);
@@ -238,19 +257,19 @@ int main(int argc, char *argv[])
   clear_screen();
 
   // Clear screen buffer
-  memset(screen_buff, 0, (SCREEN_WIDTH*(SCREEN_HEIGHT-1)));
+  memset(screen_buff, 0, SCREEN_WIDTH*SCREEN_HEIGHT*sizeof(uint16_t));
 
   // Write title
   const char *title_info = "L:     F1:Save ESC:Exit";
   uint title_char = 0;
   for(title_char=0; title_char<strlen(argv[1]); title_char++) {
-    putc_attr(title_char, 0, argv[1][title_char], TITLE_ATTRIBUTES);
+    screen_putchar(title_char, 0, argv[1][title_char], TITLE_ATTRIBUTES);
   }
   for(; title_char<SCREEN_WIDTH-strlen(title_info); title_char++) {
-    putc_attr(title_char, 0, ' ', TITLE_ATTRIBUTES);
+    screen_putchar(title_char, 0, ' ', TITLE_ATTRIBUTES);
   }
   for(; title_char<SCREEN_WIDTH; title_char++) {
-    putc_attr(title_char, 0,
+    screen_putchar(title_char, 0,
       title_info[title_char+strlen(title_info)-SCREEN_WIDTH],
       TITLE_ATTRIBUTES);
   }
@@ -261,6 +280,7 @@ int main(int argc, char *argv[])
   // Show buffer and set cursor at start
   set_show_cursor(0);
   show_buffer_at_line(buff, current_line);
+  screen_update();
   set_cursor_pos(0, 1);
   set_show_cursor(1);
 
@@ -294,9 +314,10 @@ int main(int argc, char *argv[])
 
       // Update state indicator
       if(result < ERROR_ANY) {
-        putc_attr(strlen(argv[1]), 0, ' ', TITLE_ATTRIBUTES);
+        screen_putchar(strlen(argv[1]), 0, ' ', TITLE_ATTRIBUTES);
       } else {
-        putc_attr(strlen(argv[1]), 0, '*', (TITLE_ATTRIBUTES&0xF0)|AT_T_RED);
+        screen_putchar(strlen(argv[1]), 0, '*',
+          (TITLE_ATTRIBUTES&0xF0)|AT_T_RED);
       }
       // This opperation takes some time
       // Keyboard buffer could be cleared here
@@ -349,20 +370,20 @@ int main(int argc, char *argv[])
     // Backspace key: delete char before cursor and move cursor there
     } else if(k == KEY_BACKSPACE) {
       if(buff_cursor_offset > 0) {
-        memcpy(buff+buff_cursor_offset-1, buff+buff_cursor_offset,
+        memmove(buff+buff_cursor_offset-1, buff+buff_cursor_offset,
           buff_size-buff_cursor_offset);
         buff_size--;
-        putc_attr(strlen(argv[1]), 0, '*', TITLE_ATTRIBUTES);
+        screen_putchar(strlen(argv[1]), 0, '*', TITLE_ATTRIBUTES);
         buff_cursor_offset--;
       }
 
     // Del key: delete char at cursor
     } else if(k == KEY_DEL) {
       if(buff_cursor_offset < buff_size-1) {
-        memcpy(buff+buff_cursor_offset, buff+buff_cursor_offset+1,
+        memmove(buff+buff_cursor_offset, buff+buff_cursor_offset+1,
           buff_size-buff_cursor_offset-1);
         buff_size--;
-        putc_attr(strlen(argv[1]), 0, '*', TITLE_ATTRIBUTES);
+        screen_putchar(strlen(argv[1]), 0, '*', TITLE_ATTRIBUTES);
       }
 
     // Any other key but esc: insert char at cursor
@@ -374,11 +395,11 @@ int main(int argc, char *argv[])
       if(k == KEY_TAB) {
         k = '\t';
       }
-      memcpy(buff+buff_cursor_offset+1, buff+buff_cursor_offset,
+      memmove(buff+buff_cursor_offset+1, buff+buff_cursor_offset,
         buff_size-buff_cursor_offset);
       *(buff + buff_cursor_offset++) = k;
       buff_size++;
-      putc_attr(strlen(argv[1]), 0, '*', TITLE_ATTRIBUTES);
+      screen_putchar(strlen(argv[1]), 0, '*', TITLE_ATTRIBUTES);
     }
 
     // Update cursor position and display
@@ -406,11 +427,12 @@ int main(int argc, char *argv[])
     const uint start_pos = SCREEN_WIDTH-strlen(title_info)+2;
     for(uint i=0; i<4; i++) {
       char c = i<=ibcdt?line_ibcd[ibcdt-i]+'0':' ';
-      putc_attr(start_pos+i, 0, c, TITLE_ATTRIBUTES);
+      screen_putchar(start_pos+i, 0, c, TITLE_ATTRIBUTES);
     }
 
     set_show_cursor(0);
     show_buffer_at_line(buff, current_line);
+    screen_update();
     line -= current_line;
     line += 1;
     set_cursor_pos(col, line);
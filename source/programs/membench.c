@@ -0,0 +1,153 @@
+// User program: Memory functions benchmark
+// Run with "checksum" parameter to benchmark internet checksum
+
+#include "types.h"
+#include "ulib/ulib.h"
+
+#define BENCH_SIZE  0x8000 // Bytes per operation
+#define BENCH_TIME  500    // Minimum time per test (miliseconds)
+
+// Tests
+enum BENCH_TEST {
+  BENCH_MEMCPY = 0,
+  BENCH_MEMCPY_UNALIGNED,
+  BENCH_MEMMOVE_OVERLAP,
+  BENCH_MEMSET,
+  BENCH_MEMCMP,
+  BENCH_NUM_TESTS
+};
+
+static const char *test_name[BENCH_NUM_TESTS] = {
+  "memcpy",
+  "memcpy unaligned",
+  "memmove overlapped",
+  "memset",
+  "memcmp",
+};
+
+// Bytes per timer tick of count operations of size bytes.
+// Total bytes can exceed 4GB, so they are never computed
+static uint rate(uint count, uint size, uint elapsed)
+{
+  return (count / elapsed) * size + ((count % elapsed) * size) / elapsed;
+}
+
+// Run a test until BENCH_TIME has elapsed
+// Returns bytes processed per timer tick
+static uint bench(uint test, uint8_t *a, uint8_t *b)
+{
+  uint count = 0;
+  const uint start = get_timer();
+  uint elapsed = 0;
+
+  do {
+    switch(test) {
+      case BENCH_MEMCPY:
+        memcpy(a, b, BENCH_SIZE);
+        break;
+      case BENCH_MEMCPY_UNALIGNED:
+        memcpy(a+1, b+2, BENCH_SIZE-2);
+        break;
+      case BENCH_MEMMOVE_OVERLAP:
+        memmove(a+3, a, BENCH_SIZE-3);
+        break;
+      case BENCH_MEMSET:
+        memset(a, test, BENCH_SIZE);
+        break;
+      case BENCH_MEMCMP:
+        memcmp(a, b, BENCH_SIZE);
+        break;
+    }
+    count++;
+    elapsed = get_timer() - start;
+  } while(elapsed < BENCH_TIME);
+
+  return rate(count, BENCH_SIZE, elapsed);
+}
+
+// Checksum results are stored here, so they are computed
+static volatile uint32_t checksum_sink = 0;
+
+// Reference checksum: 16-bit words, one at a time
+static uint32_t checksum_words(const uint8_t *data, size_t len)
+{
+  uint32_t sum = 0;
+  const uint16_t *p = (const uint16_t*)data;
+  while(len > 1) {
+    sum += *p++;
+    len -= 2;
+  }
+  if(len) {
+    sum += *(const uint8_t*)p;
+  }
+  return sum;
+}
+
+// Checksum buffers of size bytes until BENCH_TIME has elapsed
+// Returns bytes processed per timer tick
+static uint bench_checksum(const uint8_t *buff, size_t size, bool reference)
+{
+  uint count = 0;
+  const uint start = get_timer();
+  uint elapsed = 0;
+
+  do {
+    for(uint i=0; i<BENCH_SIZE/size; i++) {
+      checksum_sink = reference ? checksum_words(buff, size) :
+        checksum_acc(0, buff, size);
+      count++;
+    }
+    elapsed = get_timer() - start;
+  } while(elapsed < BENCH_TIME);
+
+  return rate(count, size, elapsed);
+}
+
+// Show checksum rates in MB/s for several buffer sizes
+static void checksum_mode(uint8_t *buff)
+{
+  static const size_t sizes[] = {64, 1500, BENCH_SIZE};
+  for(uint i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+    const uint rate = bench_checksum(buff, sizes[i], FALSE);
+    const uint ref = bench_checksum(buff, sizes[i], TRUE);
+    putstr("checksum %u bytes: %u.%u MB/s (16-bit loop: %u.%u MB/s)\n",
+      sizes[i], rate/1000, (rate/100)%10, ref/1000, (ref/100)%10);
+  }
+}
+
+// Program entry point
+int main(int argc, char *argv[])
+{
+  const bool checksum = (argc == 2 && strcmp(argv[1], "checksum") == 0);
+  if(argc != 1 && !checksum) {
+    putstr("usage: %s [checksum]\n", argv[0]);
+    return 0;
+  }
+
+  uint8_t *a = malloc(BENCH_SIZE);
+  uint8_t *b = malloc(BENCH_SIZE);
+  if(a == NULL || b == NULL) {
+    putstr("Error: can't allocate memory\n");
+    mfree(a);
+    mfree(b);
+    return 1;
+  }
+  memset(a, 0, BENCH_SIZE);
+  memset(b, 0, BENCH_SIZE);
+
+  if(checksum) {
+    for(uint i=0; i<BENCH_SIZE; i++) {
+      a[i] = i;
+    }
+    checksum_mode(a);
+  } else {
+    putstr("%u bytes per operation\n", BENCH_SIZE);
+    for(uint t=0; t<BENCH_NUM_TESTS; t++) {
+      putstr("%s: %u bytes/ms\n", test_name[t], bench(t, a, b));
+    }
+  }
+
+  mfree(a);
+  mfree(b);
+  return 0;
+}
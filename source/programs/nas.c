@@ -526,12 +526,14 @@ uint encode_data(uint8_t *buffer, uint offset, uint type, uint value)
   return offset;
 }
 
-// Given a file and offset, returns a file line and offset to next line start
-static uint read_line(char *buff, uint buff_size, char *file, uint offset)
+// Given an open file and offset, returns a file line and offset
+// to next line start
+static uint read_line(char *buff, uint buff_size, uint handle, uint offset)
 {
   // Clear buffer and read
   memset(buff, 0, buff_size);
-  uint readed = read_file(buff, file, offset, buff_size);
+  seek(handle, offset);
+  uint readed = read(handle, buff, buff_size);
 
   // Return on error
   if(readed >= ERROR_ANY) {
@@ -729,12 +731,13 @@ int main(int argc, char *argv[])
   // Clear references table
   memset(s_ref, 0, sizeof(s_ref));
 
-  // Input file buffer and offset
+  // Input file handle, buffer and offset
+  const uint fhandle = open(argv[1], 0);
   char fbuff[2048] = {0};
   uint foffset = 0;
   // Process input file line by line
   uint fline = 1;
-  while((foffset=read_line(fbuff, sizeof(fbuff), argv[1], foffset))!=EOF) {
+  while((foffset=read_line(fbuff, sizeof(fbuff), fhandle, foffset))!=EOF) {
     // Exit on read error
     if(foffset >= ERROR_ANY) {
       putstr("Error reading input file\n");
@@ -902,6 +905,7 @@ int main(int argc, char *argv[])
     }
     fline++;
   }
+  close(fhandle);
 
   // Symbol table is filled, resolve references
   if(ooffset != 0) {
@@ -6,6 +6,7 @@
 #include "hwio.h"
 #include "ulib/ulib.h"
 #include "fs.h"
+#include "cache.h"
 #include "sound.h"
 
 // WAV fileformat
@@ -124,6 +125,7 @@ static const uint16_t buffer_address_low = DMA_BUFFER_ADDRESS & 0xFFFF;
 // Currently playing wav file
 static struct playing_file_struct {
   char path[MAX_PATH];
+  uint handle;
   uint pos;
   uint bits;
   uint rate;
@@ -225,6 +227,23 @@ static uint bytes_to_samples(uint bytes)
   return bytes/playing_file.bytes_per_sample;
 }
 
+// Read playing file at a given position
+// Returns number of read bytes or an error code
+static uint read_playing_file(void *buff, uint pos, size_t size)
+{
+  fs_seek(playing_file.handle, pos);
+  return fs_read(playing_file.handle, buff, size);
+}
+
+// Close playing file if it's open
+static void close_playing_file()
+{
+  if(playing_file.handle < ERROR_ANY) {
+    fs_close(playing_file.handle);
+    playing_file.handle = ERROR_NOT_FOUND;
+  }
+}
+
 // Load one half of the DMA buffer from the file
 static void read_buffer(uint8_t half_index)
 {
@@ -243,7 +262,7 @@ static void read_buffer(uint8_t half_index)
       playing_file.bits == 8 ? 0x80 : 0;
     memset(buff, zero_value, half_buff_size);
 
-    const uint result = fs_read_file(buff, playing_file.path,
+    const uint result = read_playing_file(buff,
       playing_file.pos, play_state.read_remaining_bytes);
     if((int)result != play_state.read_remaining_bytes) {
       debug_putstr("Sound: Can't read wave file data at %d\n",
@@ -254,7 +273,7 @@ static void read_buffer(uint8_t half_index)
 
   } else {
 
-    const uint result = fs_read_file(buff, playing_file.path,
+    const uint result = read_playing_file(buff,
       playing_file.pos, half_buff_size);
     if(result != half_buff_size) {
       debug_putstr("Sound: Can't read wave file data at %d\n",
@@ -429,6 +448,35 @@ static void sb_single_cycle_playback()
   play_state.remaining_samples = 0;
 }
 
+// Buffer half pending to be read, see refill_buffer
+static uint8_t refill_half = 0;
+static bool refill_pending = FALSE;
+static bool refilling = FALSE;
+
+// Read the pending buffer half, if any.
+// Must run after the IRQ has been acknowledged: disk drivers
+// wait for IRQs that have the same priority as the sound one.
+// A refill requested while this runs is read by the same call
+static void refill_buffer()
+{
+  disable_interrupts();
+  if(refilling) {
+    enable_interrupts();
+    return;
+  }
+  refilling = TRUE;
+  while(refill_pending && play_state.is_playing) {
+    refill_pending = FALSE;
+    const uint8_t half = refill_half;
+    enable_interrupts();
+    read_buffer(half);
+    disable_interrupts();
+  }
+  refill_pending = FALSE;
+  refilling = FALSE;
+  enable_interrupts();
+}
+
 // IRQ service routine
 // Called when the DSP has finished playing a block
 void sound_handler()
@@ -449,7 +497,9 @@ void sound_handler()
       play_state.remaining_samples -= num_samples_in_buffer/2;
       if(play_state.remaining_samples > 0) {
 
-        read_buffer(play_state.read_buffer_half);
+        // Read it after acknowledging the interrupt
+        refill_half = play_state.read_buffer_half;
+        refill_pending = TRUE;
         if(play_state.remaining_samples <= num_samples_in_buffer/2) {
           play_state.read_buffer_half ^= 1;
           sb_single_cycle_playback();
@@ -464,6 +514,7 @@ void sound_handler()
         play_state.read_buffer_half ^= 1;
       } else {
         play_state.is_playing = FALSE;
+        close_playing_file();
         debug_putstr("Sound: Play sound %s finished\n",
           playing_file.path);
       }
@@ -481,6 +532,16 @@ void sound_handler()
   // Acknowledge hardware interrupt
   lapic_eoi();
   enable_interrupts();
+
+  // Refill the buffer. The interrupted code could be
+  // waiting for a disk: then refill when it finishes
+  if(refill_pending) {
+    if(cache_is_busy()) {
+      cache_defer(refill_buffer);
+    } else {
+      refill_buffer();
+    }
+  }
 }
 
 // Return true if a sound is still playing
@@ -508,15 +569,26 @@ void io_sound_stop()
   }
 
   play_state.is_playing = FALSE;
+  close_playing_file();
 }
 
 // Start playing a WAV file
 uint sb_play(const char *wav_file_path)
 {
+  close_playing_file();
   memset(playing_file.path, 0, sizeof(playing_file.path));
   strncpy(playing_file.path, wav_file_path,
     sizeof(playing_file.path));
 
+  // Open file
+  playing_file.handle = fs_open(playing_file.path, 0);
+  if(playing_file.handle >= ERROR_ANY) {
+    debug_putstr("Sound: Can't open wave file (%s)\n",
+      playing_file.path);
+
+    return playing_file.handle;
+  }
+
   // Start playback in buffer 0 and clear the buffer
   play_state.read_buffer_half = 0;
   memset(DMA_buffer, 0, DMA_buffer_size);
@@ -524,7 +596,7 @@ uint sb_play(const char *wav_file_path)
   // Read RIFF chunk
   RIFF_chunk_t RIFF_chunk = {0};
   uint result =
-    fs_read_file(&RIFF_chunk, playing_file.path, 0, sizeof(RIFF_chunk));
+    read_playing_file(&RIFF_chunk, 0, sizeof(RIFF_chunk));
 
   if(result != sizeof(RIFF_chunk) ||
     RIFF_chunk.RIFF != WAV_RIFF ||
@@ -532,6 +604,7 @@ uint sb_play(const char *wav_file_path)
     debug_putstr("Sound: Can't read wave file RIFF (%s)\n",
       playing_file.path);
 
+    close_playing_file();
     return ERROR_IO;
   }
   playing_file.pos = sizeof(RIFF_chunk);
@@ -539,13 +612,14 @@ uint sb_play(const char *wav_file_path)
   // Read fmt chunk
   fmt_chunk_t fmt_chunk = {0};
   do {
-    result = fs_read_file(&fmt_chunk, playing_file.path,
+    result = read_playing_file(&fmt_chunk,
       playing_file.pos, sizeof(fmt_chunk));
 
     if(result != sizeof(fmt_chunk)) {
       debug_putstr("Sound: Can't read wave file fmt (%s)\n",
         playing_file.path);
 
+      close_playing_file();
       return ERROR_IO;
     }
     playing_file.pos += fmt_chunk.fmt_length + 8;
@@ -556,6 +630,7 @@ uint sb_play(const char *wav_file_path)
   if(playing_file.bits != 8 && playing_file.bits != 16) {
     debug_putstr("Sound: Unsupported bit depth (%s,%d)\n",
       playing_file.path, playing_file.bits);
+    close_playing_file();
     return ERROR_IO;
   }
 
@@ -565,6 +640,7 @@ uint sb_play(const char *wav_file_path)
     playing_file.channels != 2) {
     debug_putstr("Sound: Unsupported number of channels (%s,%d)\n",
       playing_file.path, playing_file.channels);
+    close_playing_file();
     return ERROR_IO;
   }
   playing_file.bytes_per_sample = fmt_chunk.bit_resolution/8;
@@ -572,12 +648,13 @@ uint sb_play(const char *wav_file_path)
   // Read data chunk
   data_chunk_t data_chunk = {0};
   do {
-    result = fs_read_file(&data_chunk, playing_file.path,
+    result = read_playing_file(&data_chunk,
       playing_file.pos, sizeof(data_chunk));
 
     if(result != sizeof(data_chunk)) {
       debug_putstr("Sound: Can't read wave file data (%s)\n",
         playing_file.path);
+      close_playing_file();
       return ERROR_IO;
     }
     if(data_chunk.data != WAV_DATA) {
@@ -640,6 +717,7 @@ void io_sound_init()
   device.enabled = FALSE;
   play_state.read_buffer_half = 0;
   play_state.is_playing = FALSE;
+  playing_file.handle = ERROR_NOT_FOUND;
 
   // Check for Sound Blaster
   sb_find();
@@ -9,12 +9,16 @@
 #define SYSCALL_IO_OUT_CHAR             0x0020
 #define SYSCALL_IO_OUT_CHAR_ATTR        0x0021
 #define SYSCALL_IO_CLEAR_SCREEN         0x0022
+#define SYSCALL_IO_OUT_STRING           0x0023
+#define SYSCALL_IO_OUT_RECT             0x0024
 #define SYSCALL_IO_GET_CURSOR_POS       0x0028
 #define SYSCALL_IO_SET_CURSOR_POS       0x0029
 #define SYSCALL_IO_SET_SHOW_CURSOR      0x002A
 #define SYSCALL_IO_IN_KEY               0x0030
 #define SYSCALL_IO_OUT_CHAR_SERIAL      0x0040
+#define SYSCALL_IO_OUT_STRING_SERIAL    0x0041
 #define SYSCALL_IO_OUT_CHAR_DEBUG       0x0050
+#define SYSCALL_IO_OUT_STRING_DEBUG     0x0051
 #define SYSCALL_FS_GET_INFO             0x0060
 #define SYSCALL_FS_GET_ENTRY            0x0061
 #define SYSCALL_FS_READ_FILE            0x0062
@@ -25,11 +29,19 @@
 #define SYSCALL_FS_CREATE_DIRECTORY     0x0067
 #define SYSCALL_FS_LIST                 0x0068
 #define SYSCALL_FS_FORMAT               0x0069
+#define SYSCALL_FS_OPEN                 0x006A
+#define SYSCALL_FS_READ                 0x006B
+#define SYSCALL_FS_WRITE                0x006C
+#define SYSCALL_FS_SEEK                 0x006D
+#define SYSCALL_FS_CLOSE                0x006E
+#define SYSCALL_FS_SYNC                 0x006F
 #define SYSCALL_DATETIME_GET            0x0070
 #define SYSCALL_TIMER_GET               0x0071
 #define SYSCALL_NET_RECV                0x0080
 #define SYSCALL_NET_SEND                0x0081
 #define SYSCALL_NET_PORT                0x0082
+#define SYSCALL_NET_BIND                0x0083
+#define SYSCALL_NET_UNBIND              0x0084
 #define SYSCALL_SOUND_PLAY              0x0090
 #define SYSCALL_SOUND_STOP              0x0091
 #define SYSCALL_SOUND_IS_PLAYING        0x0092
@@ -46,6 +58,20 @@ typedef struct syscall_posattr_t {
   uint attr;
 } syscall_posattr_t;
 
+typedef struct syscall_outstr_t {
+  const char *str;
+  size_t      size;
+  uint        attr;
+} syscall_outstr_t;
+
+typedef struct syscall_rect_t {
+  uint            x;
+  uint            y;
+  uint            width;
+  uint            height;
+  const uint16_t *cells;
+} syscall_rect_t;
+
 typedef struct syscall_fsinfo_t {
   uint       disk_index;
   fs_info_t *info;
@@ -66,6 +92,17 @@ typedef struct syscall_fsrwfile_t {
   uint  flags;
 } syscall_fsrwfile_t;
 
+typedef struct syscall_fsopen_t {
+  char *path;
+  uint  flags;
+} syscall_fsopen_t;
+
+typedef struct syscall_fshandle_t {
+  uint  handle;
+  void *buff;
+  uint  count;
+} syscall_fshandle_t;
+
 typedef struct syscall_fssrcdst_t {
   char *src;
   char *dst;
@@ -81,6 +118,7 @@ typedef struct syscall_netop_t {
   net_address_t *addr;
   uint8_t       *buff;
   size_t         size;
+  uint16_t       port; // Local port. 0 for the default one
 } syscall_netop_t;
 
 #endif // _SYSCALL_H
@@ -16,7 +16,7 @@ uint syscall(uint service, void *param)
   return __res;
 }
 
-// x86 specific helper function
+// x86 specific helper functions
 static inline void stosb(void *addr, int data, size_t cnt)
 {
   __asm__ volatile("cld; rep stosb" :
@@ -25,6 +25,59 @@ static inline void stosb(void *addr, int data, size_t cnt)
                "memory", "cc");
 }
 
+static inline void stosl(void *addr, uint32_t data, size_t cnt)
+{
+  __asm__ volatile("cld; rep stosl" :
+               "=D" (addr), "=c" (cnt) :
+               "0" (addr), "1" (cnt), "a" (data) :
+               "memory", "cc");
+}
+
+static inline void movsb(void *dst, const void *src, size_t cnt)
+{
+  __asm__ volatile("cld; rep movsb" :
+               "=D" (dst), "=S" (src), "=c" (cnt) :
+               "0" (dst), "1" (src), "2" (cnt) :
+               "memory", "cc");
+}
+
+static inline void movsl(void *dst, const void *src, size_t cnt)
+{
+  __asm__ volatile("cld; rep movsl" :
+               "=D" (dst), "=S" (src), "=c" (cnt) :
+               "0" (dst), "1" (src), "2" (cnt) :
+               "memory", "cc");
+}
+
+// Descending copies: dst and src point to the last element
+static inline void movsb_down(void *dst, const void *src, size_t cnt)
+{
+  __asm__ volatile("std; rep movsb; cld" :
+               "=D" (dst), "=S" (src), "=c" (cnt) :
+               "0" (dst), "1" (src), "2" (cnt) :
+               "memory", "cc");
+}
+
+static inline void movsl_down(void *dst, const void *src, size_t cnt)
+{
+  __asm__ volatile("std; rep movsl; cld" :
+               "=D" (dst), "=S" (src), "=c" (cnt) :
+               "0" (dst), "1" (src), "2" (cnt) :
+               "memory", "cc");
+}
+
+// Compare doubles while equal
+// Returns the number of compared doubles, including the first different one
+static inline size_t cmpsl(const void *mem1, const void *mem2, size_t cnt)
+{
+  size_t left = cnt;
+  __asm__ volatile("cld; repe cmpsl" :
+               "=S" (mem1), "=D" (mem2), "=c" (left) :
+               "0" (mem1), "1" (mem2), "2" (cnt) :
+               "memory", "cc");
+  return cnt - left;
+}
+
 // Compare strings
 size_t strcmp(const char *str1, const char *str2)
 {
@@ -131,26 +184,72 @@ uint stou(char *src)
   return value;
 }
 
- // Set n bytes from dst to c
+// Memory functions use double string instructions for the
+// aligned part and byte string instructions for the rest
+
+// Set n bytes from dst to c
 void *memset(void *dst, int c, size_t n)
 {
-  stosb(dst, c, n);
+  uint8_t *vdst = dst;
+
+  // Align destination
+  const size_t head = min(n, ((-(uint)vdst) & 3));
+  stosb(vdst, c, head);
+  vdst += head;
+  n -= head;
+
+  const uint32_t c4 = (uint8_t)c * 0x01010101;
+  stosl(vdst, c4, n/4);
+  stosb(vdst + (n & ~3), c, n & 3);
   return dst;
 }
 
 // Copy n bytes from src to dst
-size_t memcpy(void *dst, const void *src, uint n)
+// Regions must not overlap. Use memmove otherwise
+size_t memcpy(void *dst, const void *src, size_t n)
 {
   uint8_t *vdst = dst;
   const uint8_t *vsrc = src;
-  const uint rdir = (src>dst)?0:1;
 
-  size_t i = 0;
-  for(i=0; i<n; i++) {
-    const size_t c = rdir?n-(i+1):i;
-    vdst[c] = vsrc[c];
+  // Align destination
+  const size_t head = min(n, ((-(uint)vdst) & 3));
+  movsb(vdst, vsrc, head);
+  vdst += head;
+  vsrc += head;
+
+  const size_t body = (n - head) & ~3;
+  movsl(vdst, vsrc, body/4);
+  movsb(vdst + body, vsrc + body, (n - head) & 3);
+  return n;
+}
+
+// Copy n bytes from src to dst
+// Regions can overlap
+size_t memmove(void *dst, const void *src, size_t n)
+{
+  uint8_t *vdst = dst;
+  const uint8_t *vsrc = src;
+
+  // Ascending copy is safe
+  if(vdst <= vsrc || vdst >= vsrc + n) {
+    return memcpy(dst, src, n);
   }
-  return i;
+
+  // Descending copy, aligning destination end
+  size_t left = n;
+  const size_t tail = min(left, ((uint)(vdst + left) & 3));
+  if(tail) {
+    movsb_down(vdst + left - 1, vsrc + left - 1, tail);
+    left -= tail;
+  }
+  if(left >= 4) {
+    movsl_down(vdst + left - 4, vsrc + left - 4, left/4);
+    left &= 3;
+  }
+  if(left) {
+    movsb_down(vdst + left - 1, vsrc + left - 1, left);
+  }
+  return n;
 }
 
 // Compare n bytes from mem1 and mem2
@@ -159,7 +258,9 @@ size_t memcmp(const void *mem1, const void *mem2, size_t n)
   const uint8_t *vmem1 = mem1;
   const uint8_t *vmem2 = mem2;
 
-  for(size_t i=0; i<n; i++) {
+  // Skip equal doubles. The last compared one is checked again
+  const size_t dwords = cmpsl(vmem1, vmem2, n/4);
+  for(size_t i=(dwords ? dwords-1 : 0)*4; i<n; i++) {
     if(vmem1[i] != vmem2[i]) {
       return vmem1[i]-vmem2[i];
     }
@@ -167,6 +268,53 @@ size_t memcmp(const void *mem1, const void *mem2, size_t n)
   return 0;
 }
 
+// Add network data to an internet checksum partial sum.
+// Doubles are added with carry, 16 bytes per iteration
+uint32_t checksum_acc(uint32_t sum, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+
+  // lea and dec preserve the carry between iterations
+  size_t blocks = len / 16;
+  if(blocks) {
+    __asm__ volatile("clc\n"
+                "1:\n\t"
+                "adcl (%1), %0\n\t"
+                "adcl 4(%1), %0\n\t"
+                "adcl 8(%1), %0\n\t"
+                "adcl 12(%1), %0\n\t"
+                "lea 16(%1), %1\n\t"
+                "dec %2\n\t"
+                "jnz 1b\n\t"
+                "adcl $0, %0" :
+                "+r"(sum), "+r"(p), "+r"(blocks) : :
+                "memory", "cc");
+  }
+
+  // Remaining doubles
+  for(size_t i=0; i<(len&15)/4; i++) {
+    __asm__("addl %1, %0\n\t"
+            "adcl $0, %0" :
+            "+r"(sum) : "m"(*(const uint32_t*)p) : "cc");
+    p += 4;
+  }
+
+  // Remaining word and byte. A byte is the low half of its word
+  uint32_t tail = 0;
+  if(len & 2) {
+    tail = *(const uint16_t*)p;
+    p += 2;
+  }
+  if(len & 1) {
+    tail += *p;
+  }
+  __asm__("addl %1, %0\n\t"
+          "adcl $0, %0" :
+          "+r"(sum) : "r"(tail) : "cc");
+
+  return sum;
+}
+
 // Allocate memory
 void *malloc(size_t size)
 {
@@ -186,12 +334,14 @@ void clear_screen()
 }
 
 // Format and output a string char by char
-// calling a putcharf_t for each output char
+// calling a putcharf_t for each output char.
+// ctx is passed to putchar unchanged
 // Supports: %d (int), %u (uint), %x (uint),
 // %s (char*), %c (char)
 #define D_STR_SIZE 24
-typedef void (putcharf_t)(char);
-static void formatstr_putf(const char *format, uint *args, putcharf_t putchar)
+typedef void (putcharf_t)(char, void*);
+static void formatstr_putf(const char *format, uint *args,
+  putcharf_t putchar, void *ctx)
 {
   size_t char_count = 0;
 
@@ -221,18 +371,18 @@ static void formatstr_putf(const char *format, uint *args, putcharf_t putchar)
         n_digits = n_digits?n_digits:8;
       } else if(*format == 's') {
         while(*(char*)value) {
-          putchar(*(char*)(value++));
+          putchar(*(char*)(value++), ctx);
           char_count++;
         }
         format++;
       } else if(*format == 'c') {
         if(n_digits) {
           while(char_count<n_digits) {
-            putchar((char)value);
+            putchar((char)value, ctx);
             char_count++;
           }
         } else {
-          putchar((char)value);
+          putchar((char)value, ctx);
           char_count++;
         }
         format++;
@@ -241,12 +391,12 @@ static void formatstr_putf(const char *format, uint *args, putcharf_t putchar)
       if(base != 0) {
 
         if(*format == 'x') {
-          putchar('0');
+          putchar('0', ctx);
           char_count++;
-          putchar('x');
+          putchar('x', ctx);
           char_count++;
         } else if(*format == 'd' && is_negative) {
-          putchar('-');
+          putchar('-', ctx);
           char_count++;
         }
 
@@ -263,63 +413,88 @@ static void formatstr_putf(const char *format, uint *args, putcharf_t putchar)
 
         value = (uint)&(digit[D_STR_SIZE-1-n]);
         while(*(char*)value) {
-          putchar(*(char*)(value++));
+          putchar(*(char*)(value++), ctx);
           char_count++;
         }
         format++;
       }
     } else {
-      putchar(*(format++));
+      putchar(*(format++), ctx);
       char_count++;
     }
   }
 }
 
 // Format a string (auxiliar elements)
-static char *ststr;
-static size_t ststr_size;
-static void stcatchar(char c)
-{
-  ststr[min(strlen(ststr), ststr_size-1)] = c;
+typedef struct ststr_t {
+  char   *str;
+  size_t  size;
+  size_t  len;
+} ststr_t;
+static void stcatchar(char c, void *ctx)
+{
+  ststr_t *st = ctx;
+  if(st->len < st->size-1) {
+    st->str[st->len++] = c;
+  }
 }
 // Format a string
 void formatstr(char *str, size_t size, char *format, ...)
 {
-  ststr = str;
-  ststr_size = size;
-  memset(ststr, 0, size);
-  formatstr_putf(format, (uint*)&format+1,
-    *(putcharf_t*)&stcatchar);
-
-  ststr[min(strlen(ststr), size-1)] = 0;
+  ststr_t st = {str, size, 0};
+  memset(str, 0, size);
+  formatstr_putf(format, (uint*)&format+1, stcatchar, &st);
+}
+
+// Formatted output is collected in a buffer and sent
+// with a single string syscall when full or finished
+#define OUTBUFF_SIZE 128
+typedef struct outbuff_t {
+  uint   service;
+  size_t len;
+  char   buff[OUTBUFF_SIZE];
+} outbuff_t;
+
+// Send buffer contents
+static void outbuff_flush(outbuff_t *ob)
+{
+  if(ob->len) {
+    syscall_outstr_t os = {0};
+    os.str = ob->buff;
+    os.size = ob->len;
+    syscall(ob->service, &os);
+    ob->len = 0;
+  }
 }
 
-// Put char serial port
-static void serial_puc(char c)
+// Add a char to buffer
+static void outbuff_putc(char c, void *ctx)
 {
-  syscall(SYSCALL_IO_OUT_CHAR_SERIAL, &c);
+  outbuff_t *ob = ctx;
+  ob->buff[ob->len++] = c;
+  if(ob->len == sizeof(ob->buff)) {
+    outbuff_flush(ob);
+  }
 }
 
 // Put formatted string serial port
 void serial_putstr(const char *format, ...)
 {
-  formatstr_putf(format, (uint*)&format+1,
-    *(putcharf_t*)&serial_puc);
-  return;
-}
-
-// Put char debug output
-static void debug_puc(char c)
-{
-  syscall(SYSCALL_IO_OUT_CHAR_DEBUG, &c);
+  outbuff_t ob;
+  ob.service = SYSCALL_IO_OUT_STRING_SERIAL;
+  ob.len = 0;
+  formatstr_putf(format, (uint*)&format+1, outbuff_putc, &ob);
+  outbuff_flush(&ob);
 }
 
 // Put formatted string debug output
 void debug_putstr(const char *format, ...)
 {
-  formatstr_putf(format, (uint*)&format+1,
-    *(putcharf_t*)&debug_puc);
-  return;
+  outbuff_t ob;
+  ob.service = SYSCALL_IO_OUT_STRING_DEBUG;
+  ob.len = 0;
+  formatstr_putf(format, (uint*)&format+1, outbuff_putc, &ob);
+  outbuff_flush(&ob);
 }
 
 // Put char in screen
@@ -340,12 +515,36 @@ void putc_attr(uint col, uint row, char c, uint8_t attr)
   syscall(SYSCALL_IO_OUT_CHAR_ATTR, &ca);
 }
 
+// Put a rectangle of cells in screen
+void putrect(uint col, uint row, uint width, uint height,
+  const uint16_t *cells)
+{
+  syscall_rect_t r = {0};
+  r.x = col;
+  r.y = row;
+  r.width = width;
+  r.height = height;
+  r.cells = cells;
+  syscall(SYSCALL_IO_OUT_RECT, &r);
+}
+
 // Put formatted string in screen
 void putstr(const char *format, ...)
 {
-  formatstr_putf(format, (uint*)&format+1,
-    *(putcharf_t*)&putc);
-  return;
+  outbuff_t ob;
+  ob.service = SYSCALL_IO_OUT_STRING;
+  ob.len = 0;
+  formatstr_putf(format, (uint*)&format+1, outbuff_putc, &ob);
+  outbuff_flush(&ob);
+}
+
+// Put size chars of a buffer in screen
+void putbuff(const char *buff, size_t size)
+{
+  syscall_outstr_t os = {0};
+  os.str = buff;
+  os.size = size;
+  syscall(SYSCALL_IO_OUT_STRING, &os);
 }
 
 // Get cursor position
@@ -405,14 +604,14 @@ int getstr(char *str, size_t n)
     // Backspace
     if(k == KEY_BACKSPACE) {
       if(i > 0) {
-        memcpy(&str[i-1], &str[i], n-i);
+        memmove(&str[i-1], &str[i], n-i);
         i--;
       }
 
     // Delete
     } else if(k == KEY_DEL) {
       if(i < n-1) {
-        memcpy(&str[i], &str[i+1], n-i-1);
+        memmove(&str[i], &str[i+1], n-i-1);
       }
 
     // Return
@@ -435,7 +634,7 @@ int getstr(char *str, size_t n)
 
     // Append char to string
     } else if(strlen(str) < n-1 && (k & 0xFF)) {
-        memcpy(&str[i+1], &str[i], n-i-2);
+        memmove(&str[i+1], &str[i], n-i-2);
         str[i++] = (k & 0xFF);
     }
 
@@ -502,6 +701,50 @@ uint write_file(void *buff, char *path, uint offset, uint count, uint flags)
   return syscall(SYSCALL_FS_WRITE_FILE, &fi);
 }
 
+// Open file
+uint open(char *path, uint flags)
+{
+  syscall_fsopen_t fi = {0};
+  fi.path = path;
+  fi.flags = flags;
+  return syscall(SYSCALL_FS_OPEN, &fi);
+}
+
+// Read open file
+uint read(uint handle, void *buff, uint count)
+{
+  syscall_fshandle_t fi = {0};
+  fi.handle = handle;
+  fi.buff = buff;
+  fi.count = count;
+  return syscall(SYSCALL_FS_READ, &fi);
+}
+
+// Write open file
+uint write(uint handle, void *buff, uint count)
+{
+  syscall_fshandle_t fi = {0};
+  fi.handle = handle;
+  fi.buff = buff;
+  fi.count = count;
+  return syscall(SYSCALL_FS_WRITE, &fi);
+}
+
+// Set open file position
+uint seek(uint handle, uint offset)
+{
+  syscall_fshandle_t fi = {0};
+  fi.handle = handle;
+  fi.count = offset;
+  return syscall(SYSCALL_FS_SEEK, &fi);
+}
+
+// Close open file
+uint close(uint handle)
+{
+  return syscall(SYSCALL_FS_CLOSE, &handle);
+}
+
 // Move entry
 uint move(char *srcpath, char *dstpath)
 {
@@ -548,6 +791,12 @@ uint format(uint disk)
   return syscall(SYSCALL_FS_FORMAT, &disk);
 }
 
+// Write delayed disk writes
+uint sync()
+{
+  return syscall(SYSCALL_FS_SYNC, 0);
+}
+
 // Get current system date and time
 void get_datetime(time_t *t)
 {
@@ -608,6 +857,18 @@ uint recv(net_address_t *src, uint8_t *buff, size_t buff_size)
   return syscall(SYSCALL_NET_RECV, &no);
 }
 
+// Get and remove data received in a bound port
+uint recv_from(uint16_t port, net_address_t *src,
+  uint8_t *buff, size_t buff_size)
+{
+  syscall_netop_t no = {0};
+  no.addr = src;
+  no.buff = buff;
+  no.size = buff_size;
+  no.port = port;
+  return syscall(SYSCALL_NET_RECV, &no);
+}
+
 // Send buffer to dst
 uint send(net_address_t *dst, uint8_t *buff, size_t len)
 {
@@ -618,11 +879,35 @@ uint send(net_address_t *dst, uint8_t *buff, size_t len)
   return syscall(SYSCALL_NET_SEND, &no);
 }
 
+// Send buffer to dst from src_port
+uint send_from(uint16_t src_port, net_address_t *dst,
+  uint8_t *buff, size_t len)
+{
+  syscall_netop_t no = {0};
+  no.addr = dst;
+  no.buff = buff;
+  no.size = len;
+  no.port = src_port;
+  return syscall(SYSCALL_NET_SEND, &no);
+}
+
 // Set reception to this port
 // Must be set once before calling recv
-void recv_set_port(uint16_t port)
+uint recv_set_port(uint16_t port)
+{
+  return syscall(SYSCALL_NET_PORT, &port);
+}
+
+// Enable reception in a port
+uint bind(uint16_t port)
+{
+  return syscall(SYSCALL_NET_BIND, &port);
+}
+
+// Disable reception in a port
+uint unbind(uint16_t port)
 {
-  syscall(SYSCALL_NET_PORT, &port);
+  return syscall(SYSCALL_NET_UNBIND, &port);
 }
 
 // Play sound file, non blocking
@@ -12,8 +12,10 @@
 uint syscall(uint service, void *param);
 
 // Memory
+// memcpy regions must not overlap, memmove regions can
 void  *memset(void *dst, int c, size_t n);
 size_t memcpy(void *dst, const void *src, size_t n);
+size_t memmove(void *dst, const void *src, size_t n);
 size_t memcmp(const void *mem1, const void *mem2, size_t n);
 
 // String management
@@ -150,6 +152,12 @@ int getstr(char *str, size_t n);
 // Put char and put formatted string in screen
 void putc(char c);
 void putc_attr(uint col, uint row, char c, uint8_t attr);
+
+// Copy a rectangle of width*height screen cells to screen at col, row.
+// cells are stored by rows. Each cell is SCREEN_CELL(c, attr)
+#define SCREEN_CELL(c, attr) ((uint16_t)((uint8_t)(c) | ((attr)<<8)))
+void putrect(uint col, uint row, uint width, uint height,
+  const uint16_t *cells);
 void clear_screen();
 
 // Put char and put formatted string in screen
@@ -159,6 +167,9 @@ void clear_screen();
 // Width modifiers allowed: %2d, %4x...
 void putstr(const char *format, ...);
 
+// Put size chars of buff in screen, unformatted
+void putbuff(const char *buff, size_t size);
+
 // Formatted strings in serial port and debug output.
 // Debug output is serial port by default
 void serial_putstr(const char *format, ...);
@@ -275,6 +286,33 @@ uint read_file(void *buff, char *path, uint offset, uint count);
 uint write_file(void *buff, char *path, uint offset, uint count, uint flags);
 
 
+// Open file
+// flags are the same as write_file flags
+// Open files are closed when the program finishes
+// Returns a file handle, ERROR_NO_SPACE if there are too many open files,
+// or ERROR_NOT_FOUND
+uint open(char *path, uint flags);
+
+// Read open file
+// Output: buff
+// Reads count bytes starting at the current position, and advances it
+// Returns number of readed bytes or ERROR_NOT_FOUND
+uint read(uint handle, void *buff, uint count);
+
+// Write open file
+// Writes count bytes starting at the current position, and advances it.
+// If file is not big enough, its size is increased.
+// Returns number of written bytes or ERROR_NOT_FOUND
+uint write(uint handle, void *buff, uint count);
+
+// Set current position of an open file to offset
+// Returns offset or ERROR_NOT_FOUND
+uint seek(uint handle, uint offset);
+
+// Close open file
+// Returns NO_ERROR or ERROR_NOT_FOUND
+uint close(uint handle);
+
 // Move entry
 // In the case of directories, they are recursively moved
 // Returns:
@@ -323,6 +361,10 @@ uint list(fs_entry_t *entry, char *path, uint n);
 // Returns 0 on success
 uint format(uint disk);
 
+// Write delayed disk writes, so they are persistent
+// Returns NO_ERROR on success
+uint sync();
+
 
 
 // About IP format
@@ -347,6 +389,10 @@ char *ip_to_str(char *str, uint8_t *ip);
 // Returns NO_ERROR on success
 uint send(net_address_t *dst, uint8_t *buff, size_t len);
 
+// Same as send, but uses src_port as source UDP port
+uint send_from(uint16_t src_port, net_address_t *dst,
+  uint8_t *buff, size_t len);
+
 // Get and remove received data from the network reception buffer.
 // src and buff are filled by the function.
 // If more than buff_size bytes were received,
@@ -360,10 +406,29 @@ uint send(net_address_t *dst, uint8_t *buff, size_t len);
 // Uses UDP protocol
 uint recv(net_address_t *src, uint8_t *buff, size_t buff_size);
 
-// Enable reception in this port and disable all others.
+// Enable reception in this port and disable the previous one.
 // Must be called once before start calling recv.
 // Specify a UDP port as parameter
-void recv_set_port(uint16_t port);
+// Return NO_ERROR on success
+uint recv_set_port(uint16_t port);
+
+// Several UDP ports can receive at the same time, each one with
+// its own reception buffer. Bind a port to enable its reception,
+// and unbind it when it's not needed anymore.
+// Up to 4 ports can be bound, including the recv_set_port one.
+// Return NO_ERROR on success
+uint bind(uint16_t port);
+uint unbind(uint16_t port);
+
+// Same as recv, but gets data received in a bound port
+uint recv_from(uint16_t port, net_address_t *src,
+  uint8_t *buff, size_t buff_size);
+
+// Add len bytes of data to an internet checksum (RFC 1071)
+// 32-bit partial sum. Start with sum 0. Words are read in memory
+// byte order. All data but the last one must have even length.
+// Fold the result to 16 bits and complement it to get the checksum
+uint32_t checksum_acc(uint32_t sum, const void *data, size_t len);
 
 
 
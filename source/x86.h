@@ -36,12 +36,36 @@ static inline void outb(uint16_t port, uint8_t data)
   __asm__ volatile("out %0,%1" : : "a"(data), "d"(port));
 }
 
+// Write word to port
+static inline void outw(uint16_t port, uint16_t data)
+{
+  __asm__ volatile("out %0,%1" : : "a"(data), "d"(port));
+}
+
 // Write double to port
 static inline void outd(uint16_t port, uint32_t data)
 {
   __asm__ volatile("out %0,%1" : : "a"(data), "d"(port));
 }
 
+// Read array of words from port
+static inline void insw(uint16_t port, void *addr, size_t cnt)
+{
+  __asm__ volatile("cld; rep insw" :
+              "=D"(addr), "=c"(cnt) :
+              "d"(port), "0"(addr), "1"(cnt) :
+              "memory", "cc");
+}
+
+// Write array of words to port
+static inline void outsw(uint16_t port, const void *addr, size_t cnt)
+{
+  __asm__ volatile("cld; rep outsw" :
+              "=S"(addr), "=c"(cnt) :
+              "d"(port), "0"(addr), "1"(cnt) :
+              "cc");
+}
+
 // Read array from port
 static inline void insl(uint16_t port, void *addr, size_t cnt)
 {
@@ -60,12 +84,36 @@ static inline void outsl(uint16_t port, const void *addr, size_t cnt)
               "cc");
 }
 
+// Copy array of doubles. Ascending, so dst must not be above src
+static inline void movsl(void *dst, const void *src, size_t cnt)
+{
+  __asm__ volatile("cld; rep movsl" :
+              "=D"(dst), "=S"(src), "=c"(cnt) :
+              "0"(dst), "1"(src), "2"(cnt) :
+              "memory", "cc");
+}
+
+// Fill array of doubles
+static inline void stosl(void *dst, uint32_t data, size_t cnt)
+{
+  __asm__ volatile("cld; rep stosl" :
+              "=D"(dst), "=c"(cnt) :
+              "0"(dst), "1"(cnt), "a"(data) :
+              "memory", "cc");
+}
+
 // Get MSR
 static inline void read_MSR(uint32_t msr, uint32_t *lo, uint32_t *hi)
 {
   __asm__ volatile("rdmsr" : "=a"(*lo), "=d"(*hi) : "c"(msr));
 }
 
+// Read time stamp counter
+static inline void rdtsc(uint32_t *lo, uint32_t *hi)
+{
+  __asm__ volatile("rdtsc" : "=a"(*lo), "=d"(*hi));
+}
+
 // Disable interrupts
 static inline void x86_cli()
 {
@@ -78,6 +126,13 @@ static inline void x86_sti()
   __asm__ volatile("sti");
 }
 
+// Enable interrupts and halt until the next one
+// No interrupt can be lost between both instructions
+static inline void x86_sti_hlt()
+{
+  __asm__ volatile("sti; hlt");
+}
+
 // Processor flags
 #define EFLAG_CF 0x001
 #define EFLAG_ZF 0x004
@@ -203,6 +203,20 @@ IRQSound_wrapper:
   popad
   iret
 
+global IRQDisk_wrapper
+IRQDisk_wrapper:
+  pushad
+  call disk_handler
+  popad
+  iret
+
+global IRQFloppy_wrapper
+IRQFloppy_wrapper:
+  pushad
+  call floppy_handler
+  popad
+  iret
+
 ; Install interrupt handler
 global install_ISR
 install_ISR: use32